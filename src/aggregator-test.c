@@ -0,0 +1,309 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+/* Loopback test of the aggregator - stands in for the plugin's state socket
+ * in a private runtime directory, starts an aggregator on a loopback TCP port
+ * and a forwarder between the two, then checks that a device whose first
+ * snapshot shows a brownout is listed by a brownouts query and is counted as
+ * connected. The plugin then restarts in the same boot and reports the
+ * brownout again as an event, which must leave the time it was first seen.
+ * Run as "pplug-power-aggregator-test <aggregator>" */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ftw.h>
+#include <glib.h>
+
+#include "ipc-wire.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define TEST_DEVICE     "loopback-test"
+#define WAIT_MS         5000        /* For each step */
+#define POLL_MS         100
+#define RETRY_MS        5000        /* Before the forwarder reconnects to a restarted plugin */
+
+#define EXIT_SKIP       77
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static int free_port (void);
+static int open_plugin (const char *path);
+static GPid spawn (const char *prog, const char *arg1, const char *arg2, const char *arg3, const char *arg4);
+static char *query (int port, const char *line);
+static gboolean wait_query (int port, const char *line, const char *expect);
+static gboolean send_brownout (int fd, int type, guint64 seq, gint64 time);
+static int wait_plugin (int lfd, int ms);
+static int remove_entry (const char *path, const struct stat *, int, struct FTW *);
+static int run_test (const char *prog, const char *dir);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* A loopback port that was free a moment ago */
+static int free_port (void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof (addr);
+    int fd, port = -1;
+
+    fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0
+        && getsockname (fd, (struct sockaddr *) &addr, &len) == 0) port = ntohs (addr.sin_port);
+    close (fd);
+    return port;
+}
+
+/* The plugin's end of the state socket */
+static int open_plugin (const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy (addr.sun_path, path, sizeof (addr.sun_path));
+
+    fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0 && listen (fd, 1) == 0) return fd;
+
+    close (fd);
+    return -1;
+}
+
+static GPid spawn (const char *prog, const char *arg1, const char *arg2, const char *arg3, const char *arg4)
+{
+    const char *argv[] = { prog, arg1, arg2, arg3, arg4, NULL };
+    GError *err = NULL;
+    GPid pid;
+
+    if (g_spawn_async (NULL, (char **) argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, &err)) return pid;
+    g_printerr ("cannot run %s - %s\n", prog, err->message);
+    g_error_free (err);
+    return 0;
+}
+
+/* One query line and the whole answer, or NULL if the aggregator is not there */
+static char *query (int port, const char *line)
+{
+    struct sockaddr_in addr;
+    GString *out;
+    char buf[256];
+    ssize_t n;
+    int fd;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (port);
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+    if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || send (fd, line, strlen (line), MSG_NOSIGNAL) < 0)
+    {
+        close (fd);
+        return NULL;
+    }
+
+    out = g_string_new (NULL);
+    while ((n = recv (fd, buf, sizeof (buf), 0)) > 0 || (n < 0 && errno == EINTR))
+        if (n > 0) g_string_append_len (out, buf, n);
+    close (fd);
+    return g_string_free (out, FALSE);
+}
+
+/* Repeats a query until its answer contains the text expected */
+static gboolean wait_query (int port, const char *line, const char *expect)
+{
+    char *res = NULL;
+    int ms;
+
+    for (ms = 0; ms < WAIT_MS; ms += POLL_MS)
+    {
+        g_free (res);
+        res = query (port, line);
+        if (res && strstr (res, expect))
+        {
+            g_free (res);
+            return TRUE;
+        }
+        g_usleep (POLL_MS * 1000);
+    }
+
+    g_printerr ("query \"%.*s\" did not give %s - got:\n%s", (int) strcspn (line, "\n"), line, expect,
+        res ? res : "no answer\n");
+    g_free (res);
+    return FALSE;
+}
+
+/* A batch from a board that booted after a brownout - the snapshot sent on
+ * connection shows it only in the conditions, while the boot checks of a
+ * panel started later raise it as an event */
+static gboolean send_brownout (int fd, int type, guint64 seq, gint64 time)
+{
+    guint8 buf[sizeof (IpcBatchHeader) + sizeof (IpcRecord)];
+    IpcBatchHeader hdr;
+    IpcRecord rec;
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic = IPC_MAGIC;
+    hdr.version = IPC_VERSION;
+    hdr.count = 1;
+    hdr.seq = seq;
+
+    memset (&rec, 0, sizeof (rec));
+    rec.type = type;
+    rec.event = type == IPC_EVENT ? IPC_COND_BROWNOUT : 0;
+    rec.time = time;
+    rec.state.conditions = IPC_COND_BROWNOUT;
+    rec.state.max_current = 5000;
+    rec.state.power_reset = 2;
+    rec.state.throttled = -1;
+
+    memcpy (buf, &hdr, sizeof (hdr));
+    memcpy (buf + sizeof (hdr), &rec, sizeof (rec));
+    return send (fd, buf, sizeof (buf), MSG_NOSIGNAL) == sizeof (buf);
+}
+
+/* The forwarder's connection to the state socket, or -1 if none came */
+static int wait_plugin (int lfd, int ms)
+{
+    struct pollfd pfd;
+
+    pfd.fd = lfd;
+    pfd.events = POLLIN;
+    if (poll (&pfd, 1, ms) == 1) return accept4 (lfd, NULL, NULL, SOCK_CLOEXEC);
+    return -1;
+}
+
+static int remove_entry (const char *path, const struct stat *, int, struct FTW *)
+{
+    return remove (path);
+}
+
+static int run_test (const char *prog, const char *dir)
+{
+    gint64 first = g_get_real_time ();
+    GPid agg, fwd = 0;
+    char *path, *spec, *expect;
+    int port, lfd, cfd = -1, status = EXIT_FAILURE;
+
+    path = g_build_filename (dir, IPC_SOCKET_NAME, NULL);
+    lfd = open_plugin (path);
+    g_free (path);
+    port = free_port ();
+    if (lfd < 0 || port < 0)
+    {
+        g_printerr ("cannot open test sockets - %s\n", g_strerror (errno));
+        if (lfd >= 0) close (lfd);
+        return EXIT_SKIP;
+    }
+
+    spec = g_strdup_printf ("127.0.0.1:%d", port);
+    agg = spawn (prog, "--tcp", spec, NULL, NULL);
+    if (agg && wait_query (port, "summary\n", "devices 0\n"))
+    {
+        fwd = spawn (prog, "--forward", spec, "--name", TEST_DEVICE);
+
+        /* The forwarder connects here once it has connected to the aggregator */
+        if (fwd) cfd = wait_plugin (lfd, WAIT_MS);
+        if (cfd < 0) g_printerr ("forwarder did not connect to the state socket\n");
+        else if (send_brownout (cfd, IPC_SNAPSHOT, 1, first) && wait_query (port, "brownouts 86400\n", TEST_DEVICE "\n")
+            && wait_query (port, "device " TEST_DEVICE "\n", " connections=1\n")
+            && wait_query (port, "summary\n", "connected 1\n"))
+        {
+            /* The panel restarts a minute later, and the forwarder follows it */
+            close (cfd);
+            cfd = wait_plugin (lfd, RETRY_MS + WAIT_MS);
+            expect = g_strdup_printf (" brownout_time=%" G_GINT64_FORMAT " ", first);
+            if (cfd < 0) g_printerr ("forwarder did not reconnect to the state socket\n");
+            else if (send_brownout (cfd, IPC_EVENT, 2, first + 60 * G_USEC_PER_SEC)
+                && wait_query (port, "device " TEST_DEVICE "\n", " seq=2 ")
+                && wait_query (port, "device " TEST_DEVICE "\n", expect)) status = EXIT_SUCCESS;
+            g_free (expect);
+        }
+    }
+
+    if (cfd >= 0) close (cfd);
+    close (lfd);
+    if (fwd) kill (fwd, SIGTERM);
+    if (agg) kill (agg, SIGTERM);
+    if (fwd) waitpid (fwd, NULL, 0);
+    if (agg) waitpid (agg, NULL, 0);
+    g_free (spec);
+    return status;
+}
+
+int main (int argc, char *argv[])
+{
+    char *dir;
+    int status;
+
+    if (argc != 2)
+    {
+        g_printerr ("Usage: %s <aggregator>\n", argv[0]);
+        return 2;
+    }
+
+    /* The forwarder finds the state socket in the runtime directory */
+    dir = g_dir_make_tmp ("pplug-power-aggregator-XXXXXX", NULL);
+    if (!dir)
+    {
+        g_printerr ("%s: cannot create runtime directory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    g_setenv ("XDG_RUNTIME_DIR", dir, TRUE);
+
+    status = run_test (argv[1], dir);
+    g_print ("aggregator loopback %s\n", status == EXIT_SUCCESS ? "passed" : status == EXIT_SKIP ? "skipped" : "failed");
+
+    nftw (dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    g_free (dir);
+    return status;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
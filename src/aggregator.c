@@ -0,0 +1,866 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Site aggregator for power plugin state. Run with --tcp and/or --unix, it
+ * accepts state streams from many devices and keeps each device's latest
+ * state in columns, answering one-line text queries such as
+ * "brownouts 86400" on the same listeners. Run with --forward on a device,
+ * it relays the plugin's local state socket to an aggregator, reconnecting
+ * to either end as needed. Run with --snapshot, it asks the local plugin for
+ * its full state and prints it. Everything can be tried on loopback:
+ *
+ *   pplug-power-aggregator --tcp 127.0.0.1:7455
+ *   pplug-power-aggregator --forward 127.0.0.1:7455
+ *   echo "summary" | nc -q 1 127.0.0.1 7455
+ *   pplug-power-aggregator --snapshot */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "ipc-wire.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define DEVICES_DEFAULT 4096
+#define EXPIRE_DEFAULT  (7 * 86400) /* Seconds before a silent device's slot can be reused */
+#define QUERY_MAX       256         /* Longest query line */
+#define QUERY_WINDOW    86400       /* Default query window in seconds */
+#define SEND_TIMEOUT    1           /* Seconds a query client has to take its reply */
+#define RETRY_SECS      5           /* Between forwarder reconnection attempts */
+#define REPLY_TIMEOUT   2           /* Seconds to wait for the plugin's full state */
+#define FORWARD_QUEUE   8           /* Frames held while the aggregator is slow to take them */
+
+typedef enum
+{
+    CONN_NEW,                       /* Nothing read yet */
+    CONN_COLLECTOR,                 /* Hello seen - batches follow */
+    CONN_QUERY                      /* Text query line */
+} ConnKind;
+
+typedef struct
+{
+    int fd;
+    ConnKind kind;
+    int device;                     /* Slot of a collector's device */
+    GString *reply;                 /* Query answer being sent */
+    gsize sent;
+    guint out_id;                   /* Waiting for the socket to take the reply */
+    guint timeout_id;
+    gsize used;
+    guint8 buf[sizeof (IpcHello) + sizeof (guint32) + IPC_FRAME_MAX];
+} Conn;
+
+/* A frame waiting to go to the aggregator - the hello or a length and batch */
+typedef struct
+{
+    gsize len;
+    guint8 data[sizeof (guint32) + IPC_FRAME_MAX];
+} Frame;
+
+/* Per-device state, one array per field, so that a site-wide query only
+ * touches the fields it tests */
+typedef struct
+{
+    int count;
+    int max;
+    char (*name)[IPC_DEVICE_MAX];
+    guint32 *conditions;
+    gint32 *max_current;
+    gint32 *power_reset;
+    gint32 *throttled;
+    gint32 *oc_total;
+    gint64 *lv_time;                /* Device wall clock usec */
+    gint64 *oc_time;
+    gint64 *brownout_time;          /* First brownout seen in the current boot */
+    guint8 (*boot_id)[IPC_BOOT_ID_LEN];
+    gint64 *last_seen;              /* Aggregator wall clock usec */
+    guint64 *last_seq;
+    guint64 *gaps;                  /* Batches lost without a snapshot */
+    guint16 *connections;           /* Collectors connected as the device */
+} Devices;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static Devices dev;
+static GHashTable *dev_index;       /* Name to slot + 1 */
+static GMainLoop *loop;
+
+static char *opt_tcp, *opt_unix, *opt_forward, *opt_name;
+static int opt_max = DEVICES_DEFAULT;
+static int opt_expire = EXPIRE_DEFAULT;
+static gboolean opt_snapshot;
+
+/* There is no authentication on either listener: any peer that can connect
+ * can claim any device name, set its state and read every device's state.
+ * Listen with --tcp only on loopback or a trusted site network. A peer can
+ * also take device slots by making up names, so when the table is full the
+ * slot of a disconnected device not heard from for --expire is reused */
+static GOptionEntry entries[] = {
+    { "tcp", 't', 0, G_OPTION_ARG_STRING, &opt_tcp, "Listen on a TCP port", "[HOST:]PORT" },
+    { "unix", 'u', 0, G_OPTION_ARG_FILENAME, &opt_unix, "Listen on a Unix socket", "PATH" },
+    { "max-devices", 'm', 0, G_OPTION_ARG_INT, &opt_max, "Devices to keep state for", "N" },
+    { "expire", 'e', 0, G_OPTION_ARG_INT, &opt_expire, "Seconds before a silent device's slot can be reused (0 for never)", "SECS" },
+    { "forward", 'f', 0, G_OPTION_ARG_STRING, &opt_forward, "Forward local state to an aggregator", "HOST:PORT|PATH" },
+    { "name", 'n', 0, G_OPTION_ARG_STRING, &opt_name, "Device name to forward as (default host name)", "NAME" },
+    { "snapshot", 's', 0, G_OPTION_ARG_NONE, &opt_snapshot, "Print the local plugin's full state", NULL },
+    { NULL }
+};
+
+/* Forwarder - frames are queued and sent as the aggregator takes them, so
+ * that a slow link cannot hold up the main loop */
+static int local_fd = -1, remote_fd = -1;
+static guint local_id, remote_id;
+static Frame fwd_queue[FORWARD_QUEUE];
+static int fwd_head, fwd_len;
+static gsize fwd_sent;              /* Bytes of the head frame already sent */
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static void devices_init (int max);
+static int reclaim_device (void);
+static int find_device (const char *name);
+static void apply_batch (int d, const guint8 *data, gsize len);
+static void query_times (GString *out, const gint64 *col, long secs);
+static void query_device (GString *out, int d);
+static gboolean run_query (const char *line, GString *out);
+static gboolean conn_collector (Conn *c);
+static gboolean conn_query (Conn *c);
+static gboolean cb_reply (gint fd, GIOCondition, gpointer data);
+static gboolean cb_reply_timeout (gpointer data);
+static void conn_close (Conn *c);
+static gboolean cb_conn (gint fd, GIOCondition cond, gpointer data);
+static gboolean cb_accept (gint fd, GIOCondition, gpointer);
+static int split_host_port (const char *spec, char **host, char **port);
+static int open_tcp (const char *spec, gboolean listening);
+static int open_unix (const char *path, gboolean listening);
+static int open_local (void);
+static void forward_stop (void);
+static void read_boot_id (guint8 *id);
+static Frame *forward_tail (void);
+static void forward_retry (void);
+static gboolean forward_start (gpointer);
+static gboolean cb_forward (gint fd, GIOCondition cond, gpointer);
+static gboolean cb_remote (gint fd, GIOCondition cond, gpointer);
+static gboolean cb_quit (gpointer);
+static void print_snapshot (const IpcFullState *full);
+static int snapshot (void);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Device table */
+
+static void devices_init (int max)
+{
+    dev.max = max;
+    dev.name = g_malloc0_n (max, IPC_DEVICE_MAX);
+    dev.conditions = g_new0 (guint32, max);
+    dev.max_current = g_new0 (gint32, max);
+    dev.power_reset = g_new0 (gint32, max);
+    dev.throttled = g_new0 (gint32, max);
+    dev.oc_total = g_new0 (gint32, max);
+    dev.lv_time = g_new0 (gint64, max);
+    dev.oc_time = g_new0 (gint64, max);
+    dev.brownout_time = g_new0 (gint64, max);
+    dev.boot_id = g_malloc0_n (max, IPC_BOOT_ID_LEN);
+    dev.last_seen = g_new0 (gint64, max);
+    dev.last_seq = g_new0 (guint64, max);
+    dev.gaps = g_new0 (guint64, max);
+    dev.connections = g_new0 (guint16, max);
+    dev_index = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+/* The disconnected device heard from least recently, if that was longer ago
+ * than the expiry time - its slot is cleared for reuse */
+static int reclaim_device (void)
+{
+    gint64 before = g_get_real_time () - (gint64) opt_expire * G_USEC_PER_SEC;
+    int d, oldest = -1;
+
+    if (opt_expire <= 0) return -1;
+    for (d = 0; d < dev.count; d++)
+        if (!dev.connections[d] && dev.last_seen[d] < before && (oldest < 0 || dev.last_seen[d] < dev.last_seen[oldest]))
+            oldest = d;
+    if (oldest < 0) return -1;
+
+    g_hash_table_remove (dev_index, dev.name[oldest]);
+    dev.conditions[oldest] = 0;
+    dev.oc_total[oldest] = 0;
+    dev.lv_time[oldest] = dev.oc_time[oldest] = dev.brownout_time[oldest] = dev.last_seen[oldest] = 0;
+    dev.last_seq[oldest] = dev.gaps[oldest] = 0;
+    memset (dev.boot_id[oldest], 0, IPC_BOOT_ID_LEN);
+    return oldest;
+}
+
+static int find_device (const char *name)
+{
+    int d = GPOINTER_TO_INT (g_hash_table_lookup (dev_index, name)) - 1;
+
+    if (d >= 0) return d;
+    if (dev.count < dev.max) d = dev.count++;
+    else if ((d = reclaim_device ()) < 0) return -1;
+
+    g_strlcpy (dev.name[d], name, IPC_DEVICE_MAX);
+    dev.max_current[d] = dev.power_reset[d] = dev.throttled[d] = -1;
+    g_hash_table_insert (dev_index, dev.name[d], GINT_TO_POINTER (d + 1));
+    return d;
+}
+
+/* Every record carries the complete state after it, so the last one wins. A
+ * brownout is only reported at boot, and a forwarder that connects after that
+ * sees it set in its first snapshot rather than as an event, so its time is
+ * that of the first record in the boot to show it - a panel or forwarder
+ * restart later in the same boot sends it again, and must not re-date it */
+static void apply_batch (int d, const guint8 *data, gsize len)
+{
+    IpcBatchHeader hdr;
+    IpcRecord rec;
+    int i;
+
+    if (len < sizeof (hdr)) return;
+    memcpy (&hdr, data, sizeof (hdr));
+    if (hdr.magic != IPC_MAGIC || hdr.version != IPC_VERSION) return;
+    if (len != sizeof (hdr) + hdr.count * sizeof (IpcRecord)) return;
+
+    for (i = 0; i < hdr.count; i++)
+    {
+        memcpy (&rec, data + sizeof (hdr) + i * sizeof (IpcRecord), sizeof (rec));
+        if (i == 0 && rec.type != IPC_SNAPSHOT && dev.last_seq[d] && hdr.seq != dev.last_seq[d] + 1) dev.gaps[d]++;
+        if (!dev.brownout_time[d] && ((rec.type == IPC_EVENT && (rec.event & IPC_COND_BROWNOUT))
+            || (rec.state.conditions & IPC_COND_BROWNOUT))) dev.brownout_time[d] = rec.time;
+
+        dev.conditions[d] = rec.state.conditions;
+        dev.max_current[d] = rec.state.max_current;
+        dev.power_reset[d] = rec.state.power_reset;
+        dev.throttled[d] = rec.state.throttled;
+        dev.oc_total[d] = rec.state.oc_total;
+        dev.lv_time[d] = rec.state.lv_time;
+        dev.oc_time[d] = rec.state.oc_time;
+    }
+
+    dev.last_seq[d] = hdr.seq;
+    dev.last_seen[d] = g_get_real_time ();
+}
+
+/* Queries */
+
+static void query_times (GString *out, const gint64 *col, long secs)
+{
+    gint64 since = g_get_real_time () - secs * G_USEC_PER_SEC;
+    int d;
+
+    for (d = 0; d < dev.count; d++)
+        if (col[d] && col[d] >= since) g_string_append_printf (out, "%s\n", dev.name[d]);
+}
+
+static void query_device (GString *out, int d)
+{
+    g_string_append_printf (out, "%s conditions=0x%02x max_current=%d power_reset=0x%x throttled=0x%x oc_total=%d "
+        "lv_time=%" G_GINT64_FORMAT " oc_time=%" G_GINT64_FORMAT " brownout_time=%" G_GINT64_FORMAT " last_seen=%"
+        G_GINT64_FORMAT " seq=%" G_GUINT64_FORMAT " gaps=%" G_GUINT64_FORMAT " connections=%d\n", dev.name[d],
+        dev.conditions[d], dev.max_current[d], dev.power_reset[d], dev.throttled[d], dev.oc_total[d], dev.lv_time[d],
+        dev.oc_time[d], dev.brownout_time[d], dev.last_seen[d], dev.last_seq[d], dev.gaps[d], dev.connections[d]);
+}
+
+/* Returns FALSE for a query that is not understood */
+static gboolean run_query (const char *line, GString *out)
+{
+    char cmd[32], arg[IPC_DEVICE_MAX];
+    long secs = QUERY_WINDOW;
+    int n, d, active = 0, conn = 0, lv = 0, oc = 0, bo = 0, weak = 0;
+    guint64 gaps = 0;
+
+    arg[0] = 0;
+    n = sscanf (line, "%31s %47s", cmd, arg);
+    if (n < 1) return FALSE;
+    if (n == 2 && strcmp (cmd, "device")) secs = atol (arg);
+
+    if (!strcmp (cmd, "brownouts")) query_times (out, dev.brownout_time, secs);
+    else if (!strcmp (cmd, "lowvoltage")) query_times (out, dev.lv_time, secs);
+    else if (!strcmp (cmd, "overcurrent")) query_times (out, dev.oc_time, secs);
+    else if (!strcmp (cmd, "stale"))
+    {
+        gint64 before = g_get_real_time () - secs * G_USEC_PER_SEC;
+        for (d = 0; d < dev.count; d++)
+            if (dev.last_seen[d] < before) g_string_append_printf (out, "%s\n", dev.name[d]);
+    }
+    else if (!strcmp (cmd, "active"))
+    {
+        for (d = 0; d < dev.count; d++)
+            if (dev.conditions[d]) g_string_append_printf (out, "%s 0x%02x\n", dev.name[d], dev.conditions[d]);
+    }
+    else if (!strcmp (cmd, "device"))
+    {
+        d = GPOINTER_TO_INT (g_hash_table_lookup (dev_index, arg)) - 1;
+        if (d >= 0) query_device (out, d);
+    }
+    else if (!strcmp (cmd, "summary"))
+    {
+        for (d = 0; d < dev.count; d++)
+        {
+            if (dev.conditions[d]) active++;
+            if (dev.conditions[d] & IPC_COND_LOW_VOLTAGE) lv++;
+            if (dev.conditions[d] & IPC_COND_OVER_CURRENT) oc++;
+            if (dev.conditions[d] & IPC_COND_BROWNOUT) bo++;
+            if (dev.max_current[d] >= 0 && dev.max_current[d] < 5000) weak++;
+            if (dev.connections[d]) conn++;
+            gaps += dev.gaps[d];
+        }
+        g_string_append_printf (out, "devices %d\nconnected %d\nactive %d\nlow_voltage %d\nover_current %d\n"
+            "brownout %d\nweak_psu %d\ngaps %" G_GUINT64_FORMAT "\n", dev.count, conn, active, lv, oc, bo, weak, gaps);
+    }
+    else return FALSE;
+
+    return TRUE;
+}
+
+/* Connections - the first bytes tell a collector's hello from a text query */
+
+/* Returns FALSE if the connection should be closed. A hello from a boot not
+ * seen before, or one that cannot say which boot it is, starts the device's
+ * brownout afresh */
+static gboolean conn_collector (Conn *c)
+{
+    static const guint8 no_boot[IPC_BOOT_ID_LEN];
+    IpcHello hello;
+    guint32 flen;
+    gsize off = 0;
+
+    if (c->kind == CONN_NEW)
+    {
+        if (c->used < sizeof (hello)) return TRUE;
+        memcpy (&hello, c->buf, sizeof (hello));
+        if (hello.version != IPC_VERSION) return FALSE;
+        hello.device[IPC_DEVICE_MAX - 1] = 0;
+        c->device = find_device (hello.device);
+        if (c->device < 0)
+        {
+            g_warning ("aggregator: device table full, refusing %s", hello.device);
+            return FALSE;
+        }
+        if (!memcmp (hello.boot_id, no_boot, IPC_BOOT_ID_LEN)
+            || memcmp (hello.boot_id, dev.boot_id[c->device], IPC_BOOT_ID_LEN))
+        {
+            memcpy (dev.boot_id[c->device], hello.boot_id, IPC_BOOT_ID_LEN);
+            dev.brownout_time[c->device] = 0;
+        }
+        dev.connections[c->device]++;
+        c->kind = CONN_COLLECTOR;
+        off = sizeof (hello);
+    }
+
+    while (c->used - off >= sizeof (flen))
+    {
+        memcpy (&flen, c->buf + off, sizeof (flen));
+        if (flen > IPC_FRAME_MAX) return FALSE;
+        if (c->used - off < sizeof (flen) + flen) break;
+        apply_batch (c->device, c->buf + off + sizeof (flen), flen);
+        off += sizeof (flen) + flen;
+    }
+
+    memmove (c->buf, c->buf + off, c->used - off);
+    c->used -= off;
+    return TRUE;
+}
+
+/* Answers a complete query line - the answer goes out as the socket takes
+ * it, so a client that does not read cannot hold up the collectors */
+static gboolean conn_query (Conn *c)
+{
+    gint64 start = g_get_monotonic_time ();
+    guint8 *nl = memchr (c->buf, '\n', c->used);
+
+    if (!nl) return c->used < QUERY_MAX;
+    *nl = 0;
+
+    c->reply = g_string_new (NULL);
+    if (!run_query ((const char *) c->buf, c->reply)) g_string_assign (c->reply, "error unknown query\n");
+    g_string_append_printf (c->reply, "# %" G_GINT64_FORMAT " us\n", g_get_monotonic_time () - start);
+
+    c->out_id = g_unix_fd_add (c->fd, G_IO_OUT, cb_reply, c);
+    c->timeout_id = g_timeout_add_seconds (SEND_TIMEOUT, cb_reply_timeout, c);
+    return FALSE;
+}
+
+static gboolean cb_reply (gint fd, GIOCondition, gpointer data)
+{
+    Conn *c = (Conn *) data;
+    ssize_t n;
+
+    n = send (fd, c->reply->str + c->sent, c->reply->len - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return G_SOURCE_CONTINUE;
+    if (n > 0) c->sent += n;
+    if (n > 0 && c->sent < c->reply->len) return G_SOURCE_CONTINUE;
+
+    c->out_id = 0;
+    conn_close (c);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean cb_reply_timeout (gpointer data)
+{
+    Conn *c = (Conn *) data;
+
+    c->timeout_id = 0;
+    conn_close (c);
+    return G_SOURCE_REMOVE;
+}
+
+static void conn_close (Conn *c)
+{
+    if (c->kind == CONN_COLLECTOR) dev.connections[c->device]--;
+    if (c->out_id) g_source_remove (c->out_id);
+    if (c->timeout_id) g_source_remove (c->timeout_id);
+    if (c->reply) g_string_free (c->reply, TRUE);
+    close (c->fd);
+    g_free (c);
+}
+
+static gboolean cb_conn (gint fd, GIOCondition cond, gpointer data)
+{
+    Conn *c = (Conn *) data;
+    guint32 magic;
+    ssize_t n;
+    gboolean keep;
+
+    n = (cond & G_IO_IN) ? recv (fd, c->buf + c->used, sizeof (c->buf) - c->used, 0) : 0;
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return G_SOURCE_CONTINUE;
+    if (n <= 0)
+    {
+        conn_close (c);
+        return G_SOURCE_REMOVE;
+    }
+    c->used += n;
+
+    if (c->kind == CONN_NEW && c->used >= sizeof (magic))
+    {
+        memcpy (&magic, c->buf, sizeof (magic));
+        if (magic != IPC_HELLO_MAGIC) c->kind = CONN_QUERY;
+    }
+
+    if (c->kind == CONN_QUERY) keep = conn_query (c);
+    else keep = conn_collector (c);
+    if (keep) return G_SOURCE_CONTINUE;
+
+    /* A query is closed once its reply has gone */
+    if (!c->reply) conn_close (c);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean cb_accept (gint fd, GIOCondition, gpointer)
+{
+    Conn *c;
+    int cfd;
+
+    cfd = accept4 (fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd < 0) return G_SOURCE_CONTINUE;
+
+    c = g_new0 (Conn, 1);
+    c->fd = cfd;
+    c->kind = CONN_NEW;
+    g_unix_fd_add (cfd, G_IO_IN | G_IO_HUP | G_IO_ERR, cb_conn, c);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Sockets */
+
+static int split_host_port (const char *spec, char **host, char **port)
+{
+    const char *colon = strrchr (spec, ':');
+
+    *host = colon ? g_strndup (spec, colon - spec) : NULL;
+    *port = g_strdup (colon ? colon + 1 : spec);
+    return **port ? 0 : -1;
+}
+
+static int open_tcp (const char *spec, gboolean listening)
+{
+    struct addrinfo hints, *res, *ai;
+    char *host, *port;
+    int fd = -1, on = 1;
+
+    if (split_host_port (spec, &host, &port) < 0)
+    {
+        g_free (host);
+        g_free (port);
+        return -1;
+    }
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+    if (getaddrinfo (host, port, &hints, &res) == 0)
+    {
+        for (ai = res; ai && fd < 0; ai = ai->ai_next)
+        {
+            fd = socket (ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (listening) setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+            if (listening ? bind (fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen (fd, SOMAXCONN) == 0
+                : connect (fd, ai->ai_addr, ai->ai_addrlen) == 0) continue;
+            close (fd);
+            fd = -1;
+        }
+        freeaddrinfo (res);
+    }
+
+    g_free (host);
+    g_free (port);
+    return fd;
+}
+
+static int open_unix (const char *path, gboolean listening)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (addr.sun_path)) return -1;
+    strcpy (addr.sun_path, path);
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (listening) unlink (path);
+    if (listening ? bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0 && listen (fd, SOMAXCONN) == 0
+        : connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0) return fd;
+
+    close (fd);
+    return -1;
+}
+
+/* The plugin's state socket - it sends a snapshot as soon as this connects */
+static int open_local (void)
+{
+    struct sockaddr_un addr;
+    char *path;
+    int fd;
+
+    path = g_build_filename (g_get_user_runtime_dir (), IPC_SOCKET_NAME, NULL);
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy (addr.sun_path, path, sizeof (addr.sun_path));
+    g_free (path);
+
+    fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0) return fd;
+
+    close (fd);
+    return -1;
+}
+
+/* Forwarder - relays each batch from the plugin's local socket as a frame */
+
+/* The kernel's ID for this boot, as 16 bytes - all zero if it cannot be read */
+static void read_boot_id (guint8 *id)
+{
+    char *text, *p;
+    int i = 0;
+
+    memset (id, 0, IPC_BOOT_ID_LEN);
+    if (!g_file_get_contents ("/proc/sys/kernel/random/boot_id", &text, NULL, NULL)) return;
+    for (p = text; *p && i < IPC_BOOT_ID_LEN * 2; p++)
+    {
+        if (*p == '-') continue;
+        if (!g_ascii_isxdigit (*p)) break;
+        id[i / 2] |= g_ascii_xdigit_value (*p) << (i % 2 ? 0 : 4);
+        i++;
+    }
+    if (i < IPC_BOOT_ID_LEN * 2) memset (id, 0, IPC_BOOT_ID_LEN);
+    g_free (text);
+}
+
+static void forward_stop (void)
+{
+    if (local_id) g_source_remove (local_id);
+    if (remote_id) g_source_remove (remote_id);
+    local_id = remote_id = 0;
+    if (local_fd >= 0) close (local_fd);
+    if (remote_fd >= 0) close (remote_fd);
+    local_fd = remote_fd = -1;
+    fwd_head = fwd_len = 0;
+    fwd_sent = 0;
+}
+
+static void forward_retry (void)
+{
+    forward_stop ();
+    g_timeout_add_seconds (RETRY_SECS, forward_start, NULL);
+}
+
+/* A free frame at the end of the queue, with the writer armed to send it */
+static Frame *forward_tail (void)
+{
+    Frame *f = &fwd_queue[(fwd_head + fwd_len++) % FORWARD_QUEUE];
+
+    if (!remote_id) remote_id = g_unix_fd_add (remote_fd, G_IO_OUT, cb_remote, NULL);
+    return f;
+}
+
+static gboolean forward_start (gpointer)
+{
+    IpcHello hello;
+    Frame *f;
+
+    remote_fd = strchr (opt_forward, '/') ? open_unix (opt_forward, FALSE) : open_tcp (opt_forward, FALSE);
+    if (remote_fd < 0) return G_SOURCE_CONTINUE;
+
+    local_fd = open_local ();
+    if (local_fd < 0 || !g_unix_set_fd_nonblocking (remote_fd, TRUE, NULL))
+    {
+        forward_stop ();
+        return G_SOURCE_CONTINUE;
+    }
+
+    memset (&hello, 0, sizeof (hello));
+    hello.magic = IPC_HELLO_MAGIC;
+    hello.version = IPC_VERSION;
+    g_strlcpy (hello.device, opt_name ? opt_name : g_get_host_name (), IPC_DEVICE_MAX);
+    read_boot_id (hello.boot_id);
+    f = forward_tail ();
+    memcpy (f->data, &hello, sizeof (hello));
+    f->len = sizeof (hello);
+
+    local_id = g_unix_fd_add (local_fd, G_IO_IN | G_IO_HUP | G_IO_ERR, cb_forward, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+/* Each batch from the plugin is queued as a frame. With the queue full the
+ * plugin is left unread, and sends a fresh snapshot in place of the batches
+ * its own queue drops once reading starts again */
+static gboolean cb_forward (gint fd, GIOCondition cond, gpointer)
+{
+    guint8 buf[IPC_FRAME_MAX];
+    guint32 flen;
+    Frame *f;
+    ssize_t n;
+
+    n = (cond & G_IO_IN) ? recv (fd, buf, sizeof (buf), 0) : 0;
+    if (n < 0 && errno == EINTR) return G_SOURCE_CONTINUE;
+    if (n <= 0)
+    {
+        /* The plugin has gone - start again with a fresh snapshot */
+        local_id = 0;
+        forward_retry ();
+        return G_SOURCE_REMOVE;
+    }
+
+    flen = n;
+    f = forward_tail ();
+    memcpy (f->data, &flen, sizeof (flen));
+    memcpy (f->data + sizeof (flen), buf, n);
+    f->len = sizeof (flen) + n;
+
+    if (fwd_len < FORWARD_QUEUE) return G_SOURCE_CONTINUE;
+    local_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Sends as much of the queue as the aggregator will take without blocking */
+static gboolean cb_remote (gint fd, GIOCondition, gpointer)
+{
+    Frame *f;
+    ssize_t n;
+
+    while (fwd_len)
+    {
+        f = &fwd_queue[fwd_head];
+        n = send (fd, f->data + fwd_sent, f->len - fwd_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return G_SOURCE_CONTINUE;
+        if (n <= 0)
+        {
+            /* The aggregator has gone - start again with a fresh snapshot */
+            remote_id = 0;
+            forward_retry ();
+            return G_SOURCE_REMOVE;
+        }
+
+        fwd_sent += n;
+        if (fwd_sent < f->len) continue;
+        fwd_sent = 0;
+        fwd_head = (fwd_head + 1) % FORWARD_QUEUE;
+        fwd_len--;
+        if (!local_id) local_id = g_unix_fd_add (local_fd, G_IO_IN | G_IO_HUP | G_IO_ERR, cb_forward, NULL);
+    }
+
+    remote_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean cb_quit (gpointer)
+{
+    g_main_loop_quit (loop);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Snapshot client - asks the local plugin for its full state, skipping the
+ * snapshot and any batches that arrive before the reply */
+
+static void print_snapshot (const IpcFullState *full)
+{
+    int i;
+
+    printf ("seq          %" G_GUINT64_FORMAT "\n", (guint64) full->seq);
+    printf ("time         %" G_GINT64_FORMAT "\n", (gint64) full->time);
+    printf ("conditions   0x%x\n", full->state.conditions);
+    printf ("max_current  %d\n", full->state.max_current);
+    printf ("power_reset  %d\n", full->state.power_reset);
+    printf ("throttled    0x%x\n", full->state.throttled);
+    printf ("oc_total     %d\n", full->state.oc_total);
+    printf ("lv_time      %" G_GINT64_FORMAT "\n", (gint64) full->state.lv_time);
+    printf ("oc_time      %" G_GINT64_FORMAT "\n", (gint64) full->state.oc_time);
+    for (i = 0; i < full->num_ports && i < IPC_PORTS_MAX; i++)
+        printf ("port         %.*s %d\n", (int) sizeof (full->ports[i].name), full->ports[i].name, full->ports[i].count);
+    printf ("power_mw     %d\n", full->power_mw);
+    printf ("session_uwh  %" G_GINT64_FORMAT "\n", (gint64) full->session_uwh);
+    printf ("day_uwh      %" G_GINT64_FORMAT "\n", (gint64) full->day_uwh);
+}
+
+static int snapshot (void)
+{
+    struct timeval tv = { REPLY_TIMEOUT, 0 };
+    guint32 req = IPC_GET_STATE;
+    IpcFullState full;
+    ssize_t n;
+    int fd;
+
+    fd = open_local ();
+    if (fd < 0)
+    {
+        fprintf (stderr, "Cannot connect to the plugin - %s\n", g_strerror (errno));
+        return 1;
+    }
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    if (send (fd, &req, sizeof (req), MSG_NOSIGNAL) != sizeof (req))
+    {
+        fprintf (stderr, "Cannot ask the plugin for its state - %s\n", g_strerror (errno));
+        close (fd);
+        return 1;
+    }
+
+    while ((n = recv (fd, &full, sizeof (full), 0)) > 0 || (n < 0 && errno == EINTR))
+    {
+        if (n < (ssize_t) sizeof (full.magic) || full.magic != IPC_FULL_MAGIC) continue;
+        close (fd);
+        if (n != sizeof (full) || full.version != IPC_FULL_VERSION)
+        {
+            fprintf (stderr, "Full state is version %d, expected %d\n", full.version, IPC_FULL_VERSION);
+            return 1;
+        }
+        print_snapshot (&full);
+        return 0;
+    }
+
+    fprintf (stderr, "No state from the plugin - %s\n", n < 0 ? g_strerror (errno) : "connection closed");
+    close (fd);
+    return 1;
+}
+
+int main (int argc, char *argv[])
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    int fd;
+
+    ctx = g_option_context_new ("- aggregate power plugin state from many devices");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &err))
+    {
+        fprintf (stderr, "%s\n", err->message);
+        return 1;
+    }
+    g_option_context_free (ctx);
+
+    if (opt_snapshot) return snapshot ();
+    if (!opt_forward && !opt_tcp && !opt_unix)
+    {
+        fprintf (stderr, "Give --tcp or --unix to aggregate, --forward to relay or --snapshot to print local state\n");
+        return 1;
+    }
+
+    loop = g_main_loop_new (NULL, FALSE);
+    g_unix_signal_add (SIGINT, cb_quit, NULL);
+    g_unix_signal_add (SIGTERM, cb_quit, NULL);
+
+    if (opt_forward)
+    {
+        if (forward_start (NULL)) g_timeout_add_seconds (RETRY_SECS, forward_start, NULL);
+    }
+    else
+    {
+        devices_init (MAX (1, opt_max));
+        if (opt_tcp)
+        {
+            if ((fd = open_tcp (opt_tcp, TRUE)) < 0)
+            {
+                fprintf (stderr, "Cannot listen on %s - %s\n", opt_tcp, g_strerror (errno));
+                return 1;
+            }
+            g_unix_fd_add (fd, G_IO_IN, cb_accept, NULL);
+        }
+        if (opt_unix)
+        {
+            if ((fd = open_unix (opt_unix, TRUE)) < 0)
+            {
+                fprintf (stderr, "Cannot listen on %s - %s\n", opt_unix, g_strerror (errno));
+                return 1;
+            }
+            g_unix_fd_add (fd, G_IO_IN, cb_accept, NULL);
+        }
+    }
+
+    g_main_loop_run (loop);
+
+    forward_stop ();
+    if (opt_unix && !opt_forward) unlink (opt_unix);
+    g_main_loop_unref (loop);
+    return 0;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,121 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Allocation counter for instrumented builds of the power plugin. Preload it
+ * into the panel with LD_PRELOAD and the plugin will attribute heap
+ * allocations to its instrumented functions; the test harness links it in
+ * directly. The aligned allocators are wrapped as well as malloc, so
+ * GLib's slice and aligned paths are counted too. Counts are per thread, so that
+ * allocations made by other threads in the panel are not attributed */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t align, size_t size);
+extern void *__libc_valloc (size_t size);
+extern void *__libc_pvalloc (size_t size);
+
+static __thread unsigned long allocs;
+
+void *malloc (size_t size)
+{
+    allocs++;
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t n, size_t size)
+{
+    allocs++;
+    return __libc_calloc (n, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    allocs++;
+    return __libc_realloc (ptr, size);
+}
+
+void *reallocarray (void *ptr, size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    allocs++;
+    return __libc_realloc (ptr, n * size);
+}
+
+/* The aligned allocators - GLib uses these for slices and aligned buffers */
+
+void *memalign (size_t align, size_t size)
+{
+    allocs++;
+    return __libc_memalign (align, size);
+}
+
+void *aligned_alloc (size_t align, size_t size)
+{
+    allocs++;
+    return __libc_memalign (align, size);
+}
+
+int posix_memalign (void **ptr, size_t align, size_t size)
+{
+    void *res;
+
+    if (align % sizeof (void *) || (align & (align - 1)) || !align) return EINVAL;
+    allocs++;
+    res = __libc_memalign (align, size);
+    if (!res) return ENOMEM;
+    *ptr = res;
+    return 0;
+}
+
+void *valloc (size_t size)
+{
+    allocs++;
+    return __libc_valloc (size);
+}
+
+void *pvalloc (size_t size)
+{
+    allocs++;
+    return __libc_pvalloc (size);
+}
+
+unsigned long pplug_power_alloc_count (void)
+{
+    return allocs;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
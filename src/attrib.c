@@ -0,0 +1,283 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Process attribution - when an alarm is raised, /proc is scanned twice a
+ * short interval apart, and the processes whose CPU time and disk I/O grew
+ * the most in between are recorded against the event. The first scan waits
+ * for the main loop to go idle, so the alarm's notification and icon are
+ * never held up by it. Each scan stops when it reaches its time budget, so a
+ * system with very many processes gets a partial answer rather than a
+ * stalled panel. While the screen is blanked nobody is there to read the
+ * lists, so events are left without one rather than walking /proc for
+ * them. The kernel keeps no per-process
+ * USB counters; USB storage traffic shows up as disk I/O, which is only
+ * readable for processes belonging to the panel's user */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <glib.h>
+#include <glib-unix.h>
+
+#ifdef POWER_HARNESS
+#include "harness.h"
+#elif defined (LXPLUG)
+#include "plugin.h"
+#else
+#include "lxutils.h"
+#endif
+
+#include "budget.h"
+#include "power.h"
+#include "attrib.h"
+#include "stats.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define ATTRIB_INTERVAL_MS  250     /* Between the two scans */
+#define ATTRIB_BUDGET_US    4000    /* Longest time one scan may take */
+#define ATTRIB_CHECK_EVERY  16      /* Processes read between clock checks */
+
+typedef struct
+{
+    int pid;
+    guint64 ticks;                  /* User and system CPU time */
+    guint64 io;                     /* Bytes read from and written to storage */
+} ProcSample;
+
+/* First scan samples kept, from the attribution share of the memory budget */
+#define ATTRIB_PROCS        (MEM_SHARE (MEM_ATTRIB) / (int) sizeof (ProcSample))
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static ProcSample samples[ATTRIB_PROCS];
+static int num_samples;
+static gint64 first_time;
+static PowerEvent *target;          /* Event being attributed */
+static gint64 target_time;          /* To tell if its history slot has been reused */
+static guint timer_id;
+static gboolean background;         /* Screen blanked - no scans are made */
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static gboolean read_proc (int pid, ProcSample *ps, char *comm);
+static int compare_pid (const void *a, const void *b);
+static void rank (PowerProc *top, int pid, const char *comm, guint32 value);
+static gboolean scan (gboolean first);
+static gboolean cb_first_scan (gpointer);
+static gboolean cb_second_scan (gpointer);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Read one process's counters, and its name if wanted, without allocating */
+static gboolean read_proc (int pid, ProcSample *ps, char *comm)
+{
+    char path[32], buf[512], *open_paren, *close_paren, *ptr;
+    guint64 utime, stime;
+    ssize_t len;
+    int fd;
+
+    ps->pid = pid;
+    ps->io = 0;
+
+    g_snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+    len = read (fd, buf, sizeof (buf) - 1);
+    close (fd);
+    if (len <= 0) return FALSE;
+    buf[len] = 0;
+
+    /* The name can itself contain spaces and parentheses */
+    open_paren = strchr (buf, '(');
+    close_paren = strrchr (buf, ')');
+    if (!open_paren || !close_paren || close_paren < open_paren) return FALSE;
+    if (sscanf (close_paren + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %" SCNu64 " %" SCNu64, &utime, &stime) != 2)
+        return FALSE;
+    ps->ticks = utime + stime;
+    if (comm)
+    {
+        *close_paren = 0;
+        g_strlcpy (comm, open_paren + 1, 16);
+    }
+
+    g_snprintf (path, sizeof (path), "/proc/%d/io", pid);
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return TRUE;
+    len = read (fd, buf, sizeof (buf) - 1);
+    close (fd);
+    if (len <= 0) return TRUE;
+    buf[len] = 0;
+
+    if ((ptr = strstr (buf, "read_bytes: "))) ps->io += g_ascii_strtoull (ptr + 12, NULL, 10);
+    if ((ptr = strstr (buf, "write_bytes: "))) ps->io += g_ascii_strtoull (ptr + 13, NULL, 10);
+    return TRUE;
+}
+
+static int compare_pid (const void *a, const void *b)
+{
+    return ((const ProcSample *) a)->pid - ((const ProcSample *) b)->pid;
+}
+
+/* Insert into a list kept in descending order of value */
+static void rank (PowerProc *top, int pid, const char *comm, guint32 value)
+{
+    int i;
+
+    if (!value) return;
+    for (i = 0; i < ATTRIB_TOP; i++)
+        if (!top[i].pid || value > top[i].value) break;
+    if (i == ATTRIB_TOP) return;
+
+    memmove (&top[i + 1], &top[i], (ATTRIB_TOP - 1 - i) * sizeof (PowerProc));
+    top[i].pid = pid;
+    top[i].value = value;
+    g_strlcpy (top[i].comm, comm, sizeof (top[i].comm));
+}
+
+/* The first scan records counters; the second compares against them */
+static gboolean scan (gboolean first)
+{
+    gint64 start = g_get_monotonic_time (), now = start;
+    double secs = (start - first_time) / (double) G_USEC_PER_SEC;
+    long hz = sysconf (_SC_CLK_TCK);
+    PowerProc cpu[ATTRIB_TOP], io[ATTRIB_TOP];
+    ProcSample ps, *prev;
+    struct dirent *de;
+    char comm[16];
+    int pid, n = 0;
+    DIR *dir;
+
+    dir = opendir ("/proc");
+    if (!dir) return FALSE;
+    if (first) num_samples = 0;
+    memset (cpu, 0, sizeof (cpu));
+    memset (io, 0, sizeof (io));
+
+    while ((de = readdir (dir)))
+    {
+        if (++n % ATTRIB_CHECK_EVERY == 0 && (now = g_get_monotonic_time ()) - start > ATTRIB_BUDGET_US) break;
+        if (!g_ascii_isdigit (de->d_name[0]) || (pid = atoi (de->d_name)) <= 0) continue;
+
+        if (first)
+        {
+            if (num_samples < ATTRIB_PROCS && read_proc (pid, &samples[num_samples], NULL)) num_samples++;
+            continue;
+        }
+
+        ps.pid = pid;
+        prev = bsearch (&ps, samples, num_samples, sizeof (ProcSample), compare_pid);
+        if (!prev || !read_proc (pid, &ps, comm)) continue;
+
+        /* A reused pid can have counters lower than the first scan saw */
+        if (hz > 0 && secs > 0.0 && ps.ticks > prev->ticks) rank (cpu, pid, comm, (ps.ticks - prev->ticks) * 1000.0 / hz / secs);
+        if (secs > 0.0 && ps.io > prev->io) rank (io, pid, comm, (ps.io - prev->io) / 1024.0 / secs);
+    }
+    closedir (dir);
+
+    if (now - start > ATTRIB_BUDGET_US) g_debug ("power: process scan stopped after %d entries", n);
+
+    if (first)
+    {
+        qsort (samples, num_samples, sizeof (ProcSample), compare_pid);
+        first_time = start;
+    }
+    else
+    {
+        memcpy (target->cpu, cpu, sizeof (cpu));
+        memcpy (target->io, io, sizeof (io));
+    }
+    return TRUE;
+}
+
+static gboolean cb_first_scan (gpointer)
+{
+    timer_id = 0;
+    if (target->time != target_time || !scan (TRUE))
+    {
+        target = NULL;
+        return G_SOURCE_REMOVE;
+    }
+
+    timer_id = POWER_TIMEOUT_ADD (ATTRIB_INTERVAL_MS, cb_second_scan, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean cb_second_scan (gpointer)
+{
+    timer_id = 0;
+    if (target->time == target_time) scan (FALSE);
+    target = NULL;
+    return G_SOURCE_REMOVE;
+}
+
+/* Only one event is attributed at a time - a second one raised within the
+ * interval shares the same activity, so is left without a list */
+void attrib_start (PowerEvent *ev)
+{
+    memset (ev->cpu, 0, sizeof (ev->cpu));
+    memset (ev->io, 0, sizeof (ev->io));
+    if (target || background) return;
+
+    target = ev;
+    target_time = ev->time;
+    timer_id = POWER_IDLE_ADD (cb_first_scan, NULL);
+}
+
+void attrib_stop (void)
+{
+    if (timer_id) g_source_remove (timer_id);
+    timer_id = 0;
+    target = NULL;
+}
+
+/* Going into the background drops any attribution under way */
+void attrib_background (gboolean active)
+{
+    background = active;
+    if (background) attrib_stop ();
+}
+
+gsize attrib_memory (void)
+{
+    return sizeof (samples);
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
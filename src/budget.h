@@ -0,0 +1,72 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+/* Memory budget for the buffers owned by the plugin */
+
+#ifndef POWER_BUDGET_H
+#define POWER_BUDGET_H
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Budget in kB - small boards can build with a lower figure. It is split into
+ * sixteenths, and each buffer is sized from its share rather than by hand:
+ *
+ *   event history          1/16    HISTORY_LEN entries in PowerPlugin
+ *   user warnings file     1/16    WARN_FILE_MAX bytes, freed once read
+ *   process attribution    3/16    ATTRIB_PROCS samples, in attrib.c
+ *   state clients          4/16    queued batches, in ipc.c
+ *   statistics             5/16    counters, histograms and wakeup sources,
+ *                                  in instrumented builds only
+ *   energy rails           1/16    per-rail totals, in energy.c
+ *
+ * The remaining 1/16 is for the rest of PowerPlugin and the small fixed
+ * tables in each module. Below 32 kB the state clients cannot have a batch
+ * queued each, so that is the smallest budget allowed */
+#ifndef MEM_BUDGET_KB
+#define MEM_BUDGET_KB 64
+#endif
+
+#if MEM_BUDGET_KB < 32
+#error "MEM_BUDGET_KB must be at least 32"
+#endif
+
+#define MEM_BUDGET          (MEM_BUDGET_KB * 1024)
+#define MEM_SHARE(n)        (MEM_BUDGET / 16 * (n))
+
+/* Shares, in sixteenths */
+#define MEM_HISTORY         1
+#define MEM_WARN_FILE       1
+#define MEM_ATTRIB          3
+#define MEM_IPC             4
+#define MEM_STATS           5
+#define MEM_ENERGY          1
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,505 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Energy integration - the PMIC on Raspberry Pi 5 reports the voltage and
+ * current of each supply rail through "vcgencmd pmic_read_adc". Readings are
+ * taken at a fixed interval, stretched while the screen is blanked, and power
+ * is integrated into watt-hours per rail, for the current session and for the
+ * current day. The day's totals, and the totals of recent days, are kept in a
+ * state file so that they survive panel restarts */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "budget.h"
+#include "energy.h"
+#include "stats.h"
+
+#ifdef ENERGY_MONITOR
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define ENERGY_INTERVAL     30      /* Seconds between readings */
+#define ENERGY_BG_INTERVAL  120     /* Seconds between readings while in the background */
+#define ENERGY_MAX_GAP      4       /* Longer gaps in intervals, such as suspend, are not integrated */
+#define ENERGY_SAVE_EVERY   20      /* Readings between state file saves */
+#define ENERGY_DAYS         31      /* Past daily totals kept in the state file */
+
+#define STATE_DIR   "pplug-power"
+#define STATE_FILE  "energy.ini"
+
+/* Compensated sum - many small increments are added to a large total, which
+ * would otherwise lose the low-order bits of each one */
+typedef struct
+{
+    double sum;
+    double comp;
+} Kahan;
+
+typedef struct
+{
+    char name[32];
+    double volts;
+    double amps;
+    gboolean have_volts;
+    gboolean have_amps;
+    double last_watts;
+    gboolean have_last;
+    Kahan session;                  /* Wh since the panel started */
+    Kahan day;                      /* Wh since midnight */
+} Rail;
+
+/* Rails tracked, from the energy share of the memory budget - 19 at the
+ * smallest budget, where a Raspberry Pi 5 reports 14 */
+#define ENERGY_RAILS        (MEM_SHARE (MEM_ENERGY) / (int) sizeof (Rail))
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static Rail rails[ENERGY_RAILS];
+static int num_rails;
+static char today[11];              /* YYYY-MM-DD */
+static gint64 last_sample;
+static int interval;                /* Seconds between readings in the current profile */
+static int last_interval;           /* Interval in force when the last reading was taken */
+static int unsaved;
+static guint timer_id;
+static GCancellable *cancellable;
+static gboolean running;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static void kahan_add (Kahan *k, double val);
+static Rail *find_rail (const char *name);
+static double date_now (char *buf);
+static char *state_path (void);
+static void load_state (void);
+static void save_state (void);
+static int compare_dates (const void *a, const void *b);
+static void new_day (const char *date);
+static int parse_adc (char *out);
+static double rail_energy (Rail *rail, double hours, gboolean gap);
+static void integrate (gint64 now);
+static void cb_adc (GObject *source, GAsyncResult *res, gpointer);
+static gboolean read_adc (void);
+static gboolean cb_sample (gpointer);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+static void kahan_add (Kahan *k, double val)
+{
+    double y = val - k->comp;
+    double t = k->sum + y;
+
+    k->comp = (t - k->sum) - y;
+    k->sum = t;
+}
+
+static Rail *find_rail (const char *name)
+{
+    int i;
+
+    for (i = 0; i < num_rails; i++)
+        if (!strcmp (rails[i].name, name)) return &rails[i];
+    if (num_rails == ENERGY_RAILS) return NULL;
+
+    memset (&rails[num_rails], 0, sizeof (Rail));
+    g_strlcpy (rails[num_rails].name, name, sizeof (rails[num_rails].name));
+    return &rails[num_rails++];
+}
+
+/* Returns the seconds since local midnight */
+static double date_now (char *buf)
+{
+    GDateTime *dt = g_date_time_new_now_local ();
+    char *str = g_date_time_format (dt, "%Y-%m-%d");
+    double secs = g_date_time_get_hour (dt) * 3600 + g_date_time_get_minute (dt) * 60 + g_date_time_get_seconds (dt);
+
+    g_strlcpy (buf, str, sizeof (today));
+    g_free (str);
+    g_date_time_unref (dt);
+    return secs;
+}
+
+/* State file */
+
+static char *state_path (void)
+{
+    return g_build_filename (g_get_user_state_dir (), STATE_DIR, STATE_FILE, NULL);
+}
+
+/* Today's per-rail totals carry on from where the last session left them,
+ * compensation terms included so that the restart loses no precision */
+static void load_state (void)
+{
+    GKeyFile *kf = g_key_file_new ();
+    char *path = state_path (), *day, **keys;
+    Rail *rail;
+    int i;
+
+    if (g_key_file_load_from_file (kf, path, G_KEY_FILE_NONE, NULL))
+    {
+        day = g_key_file_get_string (kf, "today", "date", NULL);
+        if (!g_strcmp0 (day, today))
+        {
+            keys = g_key_file_get_keys (kf, "rails", NULL, NULL);
+            for (i = 0; keys && keys[i]; i++)
+            {
+                if (!(rail = find_rail (keys[i]))) continue;
+                rail->day.sum = g_key_file_get_double (kf, "rails", keys[i], NULL);
+                rail->day.comp = g_key_file_get_double (kf, "compensation", keys[i], NULL);
+            }
+            g_strfreev (keys);
+        }
+        g_free (day);
+    }
+
+    g_key_file_free (kf);
+    g_free (path);
+}
+
+static void save_state (void)
+{
+    GKeyFile *kf = g_key_file_new ();
+    char *path = state_path (), *dir = g_path_get_dirname (path), **keys;
+    GError *err = NULL;
+    double total = 0.0;
+    gsize n;
+    int i;
+
+    /* Past days are read back and kept, latest ENERGY_DAYS only */
+    g_key_file_load_from_file (kf, path, G_KEY_FILE_KEEP_COMMENTS, NULL);
+    g_key_file_remove_group (kf, "today", NULL);
+    g_key_file_remove_group (kf, "rails", NULL);
+    g_key_file_remove_group (kf, "compensation", NULL);
+
+    g_key_file_set_string (kf, "today", "date", today);
+    for (i = 0; i < num_rails; i++)
+    {
+        g_key_file_set_double (kf, "rails", rails[i].name, rails[i].day.sum);
+        g_key_file_set_double (kf, "compensation", rails[i].name, rails[i].day.comp);
+        total += rails[i].day.sum;
+    }
+    g_key_file_set_double (kf, "days", today, total);
+
+    keys = g_key_file_get_keys (kf, "days", &n, NULL);
+    if (keys && n > ENERGY_DAYS)
+    {
+        qsort (keys, n, sizeof (char *), compare_dates);
+        for (i = 0; i < (int) n - ENERGY_DAYS; i++) g_key_file_remove_key (kf, "days", keys[i], NULL);
+    }
+    g_strfreev (keys);
+
+    g_mkdir_with_parents (dir, 0700);
+    if (!g_key_file_save_to_file (kf, path, &err))
+    {
+        g_warning ("power: cannot save energy totals - %s", err->message);
+        g_error_free (err);
+    }
+
+    unsaved = 0;
+    g_key_file_free (kf);
+    g_free (dir);
+    g_free (path);
+}
+
+/* Dates sort in order as strings */
+static int compare_dates (const void *a, const void *b)
+{
+    return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+/* Close the finished day in the state file before starting the next */
+static void new_day (const char *date)
+{
+    int i;
+
+    save_state ();
+    g_strlcpy (today, date, sizeof (today));
+    for (i = 0; i < num_rails; i++) memset (&rails[i].day, 0, sizeof (Kahan));
+}
+
+/* Readings are lines of the form " 3V7_WL_SW_A current(0)=0.05853000A", a
+ * rail's voltage and current being reported under its name with _V and _A */
+static int parse_adc (char *out)
+{
+    char *line, *save, *eq, name[32];
+    double val;
+    size_t len;
+    Rail *rail;
+    int readings = 0;
+
+    for (line = strtok_r (out, "\n", &save); line; line = strtok_r (NULL, "\n", &save))
+    {
+        eq = strchr (line, '=');
+        if (!eq || sscanf (line, " %31s", name) != 1) continue;
+        len = strlen (name);
+        if (len < 3 || name[len - 2] != '_') continue;
+
+        val = g_ascii_strtod (eq + 1, NULL);
+        name[len - 2] = 0;
+        if (!(rail = find_rail (name))) continue;
+
+        if (name[len - 1] == 'V')
+        {
+            rail->volts = val;
+            rail->have_volts = TRUE;
+        }
+        else if (name[len - 1] == 'A')
+        {
+            rail->amps = val;
+            rail->have_amps = TRUE;
+        }
+        else continue;
+        readings++;
+    }
+    return readings;
+}
+
+/* Trapezoidal integration of a rail's power since the last reading */
+static double rail_energy (Rail *rail, double hours, gboolean gap)
+{
+    double watts, wh = 0.0;
+
+    if (!rail->have_volts || !rail->have_amps) return 0.0;
+
+    watts = rail->volts * rail->amps;
+    if (rail->have_last && !gap) wh = (rail->last_watts + watts) / 2.0 * hours;
+    rail->last_watts = watts;
+    rail->have_last = TRUE;
+    rail->have_volts = rail->have_amps = FALSE;
+    return wh;
+}
+
+/* An interval spanning midnight is shared between the two days in proportion
+ * to the time on each side of it */
+static void integrate (gint64 now)
+{
+    double hours = (now - last_sample) / (3600.0 * G_USEC_PER_SEC), wh[ENERGY_RAILS], after = 1.0, secs;
+    gboolean gap = !last_sample || now - last_sample > ENERGY_MAX_GAP * MAX (interval, last_interval) * G_USEC_PER_SEC;
+    gboolean rollover;
+    char date[sizeof (today)];
+    int i;
+
+    secs = date_now (date);
+    rollover = strcmp (date, today) != 0;
+    if (rollover && hours > 0.0) after = MIN (1.0, secs / 3600.0 / hours);
+
+    for (i = 0; i < num_rails; i++)
+    {
+        wh[i] = rail_energy (&rails[i], hours, gap);
+        kahan_add (&rails[i].session, wh[i]);
+        if (rollover) kahan_add (&rails[i].day, wh[i] * (1.0 - after));
+    }
+
+    if (rollover) new_day (date);
+    for (i = 0; i < num_rails; i++) kahan_add (&rails[i].day, wh[i] * after);
+
+    last_sample = now;
+    last_interval = interval;
+    if (++unsaved >= ENERGY_SAVE_EVERY) save_state ();
+}
+
+static void cb_adc (GObject *source, GAsyncResult *res, gpointer)
+{
+    char *out = NULL;
+    GError *err = NULL;
+    int readings;
+
+    if (!g_subprocess_communicate_utf8_finish (G_SUBPROCESS (source), res, &out, NULL, &err))
+    {
+        if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) g_warning ("power: PMIC read failed - %s", err->message);
+        g_error_free (err);
+        g_object_unref (source);
+        return;
+    }
+    STAT_DISPATCH_BEGIN ();
+
+    readings = out ? parse_adc (out) : 0;
+    g_free (out);
+    g_object_unref (source);
+
+    /* Boards without a PMIC report nothing, so stop asking */
+    if (!readings)
+    {
+        if (timer_id) g_source_remove (timer_id);
+        timer_id = 0;
+    }
+    else integrate (g_get_monotonic_time ());
+
+    STAT_DISPATCH_END ();
+}
+
+/* The command runs asynchronously so that the panel never waits on the firmware */
+static gboolean read_adc (void)
+{
+    GSubprocess *proc;
+
+    proc = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_SILENCE, NULL,
+        "vcgencmd", "pmic_read_adc", NULL);
+    if (!proc) return FALSE;
+    g_subprocess_communicate_utf8_async (proc, NULL, cancellable, cb_adc, NULL);
+    return TRUE;
+}
+
+static gboolean cb_sample (gpointer)
+{
+    if (read_adc ()) return G_SOURCE_CONTINUE;
+    timer_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+void energy_start (void)
+{
+    if (running) return;
+    running = TRUE;
+    num_rails = 0;
+    last_sample = 0;
+    interval = last_interval = ENERGY_INTERVAL;
+    unsaved = 0;
+    date_now (today);
+    load_state ();
+
+    cancellable = g_cancellable_new ();
+    if (read_adc ()) timer_id = POWER_TIMEOUT_ADD (interval * 1000, cb_sample, NULL);
+}
+
+/* While nobody can see the totals the panel is woken less often; the gap
+ * allowed between readings grows with the interval, so only detail is lost */
+void energy_background (gboolean background)
+{
+    int secs = background ? ENERGY_BG_INTERVAL : ENERGY_INTERVAL;
+
+    if (!running || secs == interval) return;
+    interval = secs;
+    if (!timer_id) return;
+
+    g_source_remove (timer_id);
+    timer_id = POWER_TIMEOUT_ADD (interval * 1000, cb_sample, NULL);
+}
+
+/* Seconds between readings, or 0 if none are being taken */
+int energy_interval (void)
+{
+    return running && timer_id ? interval : 0;
+}
+
+/* The per-rail totals */
+gsize energy_memory (void)
+{
+    return sizeof (rails);
+}
+
+#ifdef POWER_HARNESS
+
+/* One reading, as the PMIC would report it, taken at the given monotonic time
+ * - for the soak test, which runs on a virtual clock */
+void energy_sample (const char *adc, gint64 now)
+{
+    char *out = g_strdup (adc);
+
+    if (!interval) interval = last_interval = ENERGY_INTERVAL;
+    if (!*today) date_now (today);
+    if (parse_adc (out)) integrate (now);
+    g_free (out);
+}
+
+#endif
+
+void energy_stop (void)
+{
+    if (!running) return;
+    running = FALSE;
+
+    if (timer_id) g_source_remove (timer_id);
+    timer_id = 0;
+    g_cancellable_cancel (cancellable);
+    g_clear_object (&cancellable);
+
+    if (num_rails) save_state ();
+}
+
+/* Text for the information dialog - ownership passes to the caller */
+char *energy_summary (void)
+{
+    GString *str;
+    double session = 0.0, day = 0.0;
+    int i;
+
+    if (!num_rails) return NULL;
+    for (i = 0; i < num_rails; i++)
+    {
+        session += rails[i].session.sum;
+        day += rails[i].day.sum;
+    }
+
+    str = g_string_new (NULL);
+    g_string_append_printf (str, _("%.3f Wh this session, %.3f Wh today"), session, day);
+    for (i = 0; i < num_rails; i++)
+        g_string_append_printf (str, "\n%s: %.3f Wh, %.3f Wh", rails[i].name, rails[i].session.sum, rails[i].day.sum);
+
+    return g_string_free (str, FALSE);
+}
+
+/* Totals over all rails, from the last reading taken - watts is -1 until
+ * there has been one. Returns FALSE if there is nothing to report */
+gboolean energy_totals (double *watts, double *session_wh, double *day_wh)
+{
+    gboolean measured = FALSE;
+    int i;
+
+    *watts = *session_wh = *day_wh = 0.0;
+    if (!num_rails) return FALSE;
+    for (i = 0; i < num_rails; i++)
+    {
+        if (rails[i].have_last)
+        {
+            *watts += rails[i].last_watts;
+            measured = TRUE;
+        }
+        *session_wh += rails[i].session.sum;
+        *day_wh += rails[i].day.sum;
+    }
+    if (!measured) *watts = -1.0;
+    return TRUE;
+}
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,476 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Test harness - the plugin's own sources built into a standalone program,
+ * with desktop notifications recorded rather than shown and the commands
+ * the checks run answered with canned output, so that results do not depend
+ * on the machine running them. Each command exits 0 on a pass, 1 on a
+ * failure, 2 on a usage error and 77 where GTK cannot be started, which
+ * meson counts as a skipped test */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/socket.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "harness.h"
+#include "budget.h"
+#include "power.h"
+#include "replay.h"
+#include "stats.h"
+#include "energy.h"
+#include "uevent-file.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define EXIT_USAGE  2
+#define EXIT_SKIP   77
+
+/* Devices the benchmark events come from */
+#define BENCH_HWMON "/devices/platform/soc/soc:firmware/raspberrypi-hwmon/hwmon/hwmon1"
+#define BENCH_HUB   "devices/platform/axi/1000120000.pcie/1f00200000.usb/xhci-hcd.0/usb1/1-1"
+#define BENCH_PORT  BENCH_HUB "/1-1:1.0/1-1-port1"
+
+#define BENCH_ITERATIONS 1000
+
+#define WAKEUP_SECONDS 10
+
+#define SOAK_DAYS 7
+
+typedef struct
+{
+    const char *cmd;                /* Start of the command line */
+    int status;                     /* Exit status */
+    const char *output;             /* Standard output */
+} CannedCommand;
+
+/* A hot function, called directly or by handling a uevent as its callback would */
+typedef struct
+{
+    const char *name;
+    StatId id;                      /* Where its allocations and spawns are counted */
+    const char *uevent;             /* Space-separated KEY=value pairs, or NULL */
+} BenchItem;
+
+typedef struct
+{
+    const char *name;
+    const char *args;
+    const char *help;
+    gboolean pi;                    /* Start the monitors and startup checks, as on a Pi */
+    int (*run) (PowerPlugin *pt, int argc, char **argv);
+} Command;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static const CannedCommand *find_canned (const char *cmd);
+static void cb_done (gboolean passed);
+static gboolean wait_done (void);
+static int cmd_scenarios (PowerPlugin *pt, int argc, char **argv);
+static int cmd_replay (PowerPlugin *pt, int argc, char **argv);
+static int cmd_stress (PowerPlugin *pt, int argc, char **argv);
+static void bench_once (PowerPlugin *pt, const BenchItem *b, const char *payload, int len);
+static void bench_item (PowerPlugin *pt, const BenchItem *b, int iterations);
+static int cmd_bench (PowerPlugin *pt, int argc, char **argv);
+static int cmd_soak (PowerPlugin *pt, int argc, char **argv);
+static guint64 energy_wakeups (void);
+static gboolean cb_wakeups_end (gpointer);
+static int cmd_wakeups (PowerPlugin *pt, int argc, char **argv);
+static gboolean write_fixture (void);
+static int remove_entry (const char *path, const struct stat *, int, struct FTW *);
+static int usage (const char *prog);
+static int run_command (int argc, char *argv[]);
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+gboolean harness_is_pi;
+
+/* Not a Compute Module 5, with 8GB of memory and a 1080p display */
+static const CannedCommand canned[] = {
+    { "raspi-config nonint is_cmfive",  1, "" },
+    { "vcgencmd get_config total_mem",  0, "8192\n" },
+    { "wlr-randr",                      0, "1920x1080\n" }
+};
+
+static const Command commands[] = {
+    { "scenarios",  "[all|<name>,...]",             "run scripted fault scenarios", FALSE, cmd_scenarios },
+    { "replay",     "<file> [fast]",                "feed a uevent recording through the handlers", FALSE, cmd_replay },
+    { "stress",     "<type>[:<rate>[:<secs>]]",     "run a uevent storm, failing on steady-state allocations", FALSE, cmd_stress },
+    { "bench",      "[iterations]",                 "time the hot functions against fixture data", FALSE, cmd_bench },
+    { "wakeups",    "[<secs>[:<budget>]]",          "count wakeups on a healthy board, failing over budget", TRUE, cmd_wakeups },
+    { "soak",       "[days]",                       "simulate days of faults, failing if memory use grows", FALSE, cmd_soak }
+};
+
+/* A 5A supply, no brownout, two user warnings and no alarms raised, so that
+ * each call after the first takes the path it would take on a healthy board */
+static const char *healthy_fixture[][2] = {
+    { "/proc/device-tree/chosen/power/max_current", "u32:5000" },
+    { "/proc/device-tree/chosen/power/power_reset", "u32:0" },
+    { "/proc/device-tree/chosen/user-warnings",     "Example warning\nAnother example warning\n" },
+    { "/proc/sys/kernel/random/boot_id",            "3c9a4cf0-6c1a-4c57-9a3f-2d1b1e0c6f4e\n" },
+    { "/sys/" BENCH_PORT "/disable",                "0" },
+    { "/sys" BENCH_HWMON "/in0_lcrit_alarm",        "0" }
+};
+
+static const BenchItem bench_items[] = {
+    { "check_psu",              STAT_CHECK_PSU,             NULL },
+    { "check_brownout",         STAT_CHECK_BROWNOUT,        NULL },
+    { "check_user_warnings",    STAT_CHECK_USER_WARNINGS,   NULL },
+    { "check_memres",           STAT_CHECK_MEMRES,          NULL },
+    { "cb_overcurrent_fd",      STAT_UEVENT,                "ACTION=change SUBSYSTEM=usb DEVPATH=/" BENCH_HUB
+                                                            " OVER_CURRENT_PORT=" BENCH_PORT " OVER_CURRENT_COUNT=1" },
+    { "cb_lowvoltage_fd",       STAT_UEVENT,                "ACTION=change SUBSYSTEM=hwmon DEVPATH=" BENCH_HWMON },
+    { "update_icon",            STAT_UPDATE_ICON,           NULL }
+};
+
+static GMainLoop *loop;
+static gboolean finished;
+static gboolean result;
+static guint64 wakeups;
+static guint64 wakeup_budget;
+static guint64 energy_base;
+static guint64 energy_budget;
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Stubs for the panel and the system */
+
+void harness_notify (const char *msg, gboolean critical)
+{
+    g_debug ("power: %s notification - %s", critical ? "critical" : "normal", msg);
+}
+
+static const CannedCommand *find_canned (const char *cmd)
+{
+    int i;
+
+    for (i = 0; i < (int) G_N_ELEMENTS (canned); i++)
+        if (g_str_has_prefix (cmd, canned[i].cmd)) return &canned[i];
+    g_warning ("power: no canned output for %s", cmd);
+    return NULL;
+}
+
+/* Returns a wait status, as system does */
+int harness_system (const char *cmd)
+{
+    const CannedCommand *c = find_canned (cmd);
+
+    return c ? c->status << 8 : -1;
+}
+
+FILE *harness_popen (const char *cmd)
+{
+    const CannedCommand *c = find_canned (cmd);
+
+    if (!c) return NULL;
+    if (!*c->output) return fopen ("/dev/null", "r");
+    return fmemopen ((void *) c->output, strlen (c->output), "r");
+}
+
+/* Completion of asynchronous commands */
+
+static void cb_done (gboolean passed)
+{
+    finished = TRUE;
+    result = passed;
+    g_main_loop_quit (loop);
+}
+
+/* Commands can fail before the loop runs, so only run it if still waiting */
+static gboolean wait_done (void)
+{
+    if (!finished) g_main_loop_run (loop);
+    return result;
+}
+
+/* Commands */
+
+static int cmd_scenarios (PowerPlugin *pt, int argc, char **argv)
+{
+    return scenario_run (pt, argc > 0 ? argv[0] : "all") ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int cmd_replay (PowerPlugin *pt, int argc, char **argv)
+{
+    if (argc < 1) return EXIT_USAGE;
+    replay_start (pt, argv[0], argc > 1 && !strcmp (argv[1], "fast"), cb_done);
+    return wait_done () ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int cmd_stress (PowerPlugin *pt, int argc, char **argv)
+{
+    if (argc < 1) return EXIT_USAGE;
+    stress_start (pt, argv[0], cb_done);
+    return wait_done () ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Benchmark - the fd callbacks are timed through the uevent handler, as the
+ * fixture cannot stand in for the udev monitor socket */
+
+static void bench_once (PowerPlugin *pt, const BenchItem *b, const char *payload, int len)
+{
+    PowerUevent ev;
+
+    if (b->uevent)
+    {
+        replay_parse (payload, len, &ev);
+        ev.recv_time = scenario_now ();
+        power_uevent (pt, &ev);
+    }
+    else power_bench_call (pt, b->id);
+}
+
+static void bench_item (PowerPlugin *pt, const BenchItem *b, int iterations)
+{
+    char payload[UEVENT_PAYLOAD_MAX], *ptr;
+    guint64 allocs, spawns;
+    gint64 start, elapsed;
+    int i, len = 0;
+
+    if (b->uevent)
+    {
+        len = g_strlcpy (payload, b->uevent, sizeof (payload)) + 1;
+        for (ptr = payload; *ptr; ptr++)
+            if (*ptr == ' ') *ptr = 0;
+    }
+
+    /* One untimed call first, so that one-off costs such as loading the icon are left out */
+    bench_once (pt, b, payload, len);
+
+    allocs = stats_get_allocs (b->id);
+    spawns = stats_get_spawns (b->id);
+    start = stats_now_ns ();
+    for (i = 0; i < iterations; i++) bench_once (pt, b, payload, len);
+    elapsed = stats_now_ns () - start;
+
+    g_print ("%-20s %8d %10" G_GINT64_FORMAT " %12.2f %12.2f\n", b->name, iterations, elapsed / iterations,
+        (stats_get_allocs (b->id) - allocs) / (double) iterations, (stats_get_spawns (b->id) - spawns) / (double) iterations);
+}
+
+static int cmd_bench (PowerPlugin *pt, int argc, char **argv)
+{
+    int i, iterations = argc > 0 ? atoi (argv[0]) : BENCH_ITERATIONS;
+
+    if (iterations <= 0) return EXIT_USAGE;
+    if (!stats_allocs_counted ()) g_message ("power: allocations are not being counted");
+
+    if (!write_fixture ()) return EXIT_FAILURE;
+
+    g_print ("%-20s %8s %10s %12s %12s\n", "function", "calls", "ns/call", "allocs/call", "spawns/call");
+    for (i = 0; i < (int) G_N_ELEMENTS (bench_items); i++) bench_item (pt, &bench_items[i], iterations);
+
+    scenario_fixture_end ();
+    return EXIT_SUCCESS;
+}
+
+static int cmd_soak (PowerPlugin *pt, int argc, char **argv)
+{
+    int days = argc > 0 ? atoi (argv[0]) : SOAK_DAYS;
+
+    if (days <= 0) return EXIT_USAGE;
+    return soak_run (pt, days) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Wakeups - the baseline is taken once startup has finished, so that a healthy
+ * board with nothing happening can be held to a budget of zero. The monitors
+ * are pointed at a socket of the harness's own, so that uevents and kernel log
+ * records from the machine running the test are not counted */
+
+/* Energy readings are the one thing the plugin polls for. Each costs a timer
+ * wakeup and one for the command finishing, so they are held to a budget of
+ * their own, worked out from the interval, and not counted against the rest */
+static guint64 energy_wakeups (void)
+{
+    return stats_get_source_wakeups ("cb_sample") + stats_get_source_wakeups ("cb_adc");
+}
+
+static gboolean cb_wakeups_end (gpointer)
+{
+    guint64 energy = energy_wakeups () - energy_base;
+    guint64 total = stats_get_wakeups () - wakeups - energy;
+
+    stats_wakeup_report ();
+    g_message ("power: %" G_GUINT64_FORMAT " wakeups, budget %" G_GUINT64_FORMAT, total, wakeup_budget);
+    g_message ("power: %" G_GUINT64_FORMAT " energy reading wakeups, budget %" G_GUINT64_FORMAT, energy, energy_budget);
+    cb_done (total <= wakeup_budget && energy <= energy_budget);
+    return G_SOURCE_REMOVE;
+}
+
+static int cmd_wakeups (PowerPlugin *pt, int argc, char **argv)
+{
+    char **args = g_strsplit (argc > 0 ? argv[0] : "", ":", 2);
+    int seconds = args[0] && *args[0] ? atoi (args[0]) : WAKEUP_SECONDS;
+    int fds[2];
+    gboolean passed;
+
+    wakeup_budget = args[0] && args[1] ? g_ascii_strtoull (args[1], NULL, 10) : 0;
+    g_strfreev (args);
+    if (seconds <= 0) return EXIT_USAGE;
+    if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+        g_message ("power: cannot create monitor socket - %s", g_strerror (errno));
+        return EXIT_FAILURE;
+    }
+    if (!write_fixture ())
+    {
+        close (fds[0]);
+        close (fds[1]);
+        return EXIT_FAILURE;
+    }
+    power_monitor_fd (pt, fds[0]);
+
+    /* Let the startup checks and anything they set off run before counting */
+    while (pt->startup_id) g_main_context_iteration (NULL, TRUE);
+    while (g_main_context_pending (NULL)) g_main_context_iteration (NULL, FALSE);
+
+    wakeups = stats_get_wakeups ();
+    energy_base = energy_wakeups ();
+    energy_budget = 0;
+#ifdef ENERGY_MONITOR
+    if (energy_interval ()) energy_budget = 2 * (seconds / energy_interval () + 1);
+#endif
+    g_timeout_add_seconds (seconds, cb_wakeups_end, NULL);
+    passed = wait_done ();
+
+    /* The loop does not run again, so the plugin's source can be left for the destructor to remove */
+    close (fds[0]);
+    close (fds[1]);
+    scenario_fixture_end ();
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static gboolean write_fixture (void)
+{
+    int i;
+
+    if (!scenario_fixture_begin ()) return FALSE;
+    for (i = 0; i < (int) G_N_ELEMENTS (healthy_fixture); i++)
+    {
+        if (scenario_fixture_write (healthy_fixture[i][0], healthy_fixture[i][1])) continue;
+        g_message ("power: cannot write fixture %s", healthy_fixture[i][0]);
+        scenario_fixture_end ();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int remove_entry (const char *path, const struct stat *, int, struct FTW *)
+{
+    return remove (path);
+}
+
+static int usage (const char *prog)
+{
+    int i;
+
+    g_printerr ("Usage: %s <command> [args]\n", prog);
+    for (i = 0; i < (int) G_N_ELEMENTS (commands); i++)
+        g_printerr ("  %-10s %-28s %s\n", commands[i].name, commands[i].args, commands[i].help);
+    return EXIT_USAGE;
+}
+
+/* Runs the named command against a plugin instance set up as the panel would */
+static int run_command (int argc, char *argv[])
+{
+    const Command *cmd = NULL;
+    GtkWidget *window;
+    PowerPlugin *pt;
+    int i, status;
+
+    if (argc > 1)
+        for (i = 0; i < (int) G_N_ELEMENTS (commands); i++)
+            if (!strcmp (argv[1], commands[i].name)) cmd = &commands[i];
+    if (!cmd) return usage (argv[0]);
+
+    loop = g_main_loop_new (NULL, FALSE);
+
+    /* The plugin's button goes in a window that is never shown on screen */
+    window = gtk_offscreen_window_new ();
+    pt = g_new0 (PowerPlugin, 1);
+    pt->plugin = gtk_button_new ();
+    gtk_container_add (GTK_CONTAINER (window), pt->plugin);
+    gtk_widget_show (window);
+    harness_is_pi = cmd->pi;
+    power_init (pt);
+
+    status = cmd->run (pt, argc - 2, argv + 2);
+    if (status == EXIT_USAGE) usage (argv[0]);
+
+    power_destructor (pt);
+    gtk_widget_destroy (window);
+    g_main_loop_unref (loop);
+    return status;
+}
+
+int main (int argc, char *argv[])
+{
+    char *dir, *bus;
+    int status;
+
+    /* Keep the warnings record, state socket and buses away from the user's own */
+    dir = g_dir_make_tmp ("pplug-power-harness-XXXXXX", NULL);
+    if (!dir)
+    {
+        g_printerr ("%s: cannot create state directory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    bus = g_strdup_printf ("unix:path=%s/bus", dir);
+    g_setenv ("XDG_STATE_HOME", dir, TRUE);
+    g_setenv ("XDG_RUNTIME_DIR", dir, TRUE);
+    g_setenv ("DBUS_SESSION_BUS_ADDRESS", bus, TRUE);
+    g_setenv ("DBUS_SYSTEM_BUS_ADDRESS", bus, TRUE);
+    g_setenv ("NO_AT_BRIDGE", "1", TRUE);
+    g_free (bus);
+
+    if (gtk_init_check (&argc, &argv)) status = run_command (argc, argv);
+    else
+    {
+        g_printerr ("%s: cannot open display, skipping\n", argv[0]);
+        status = EXIT_SKIP;
+    }
+
+    nftw (dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    g_free (dir);
+    return status;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,79 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Stand-in for the panel plugin interface when the plugin sources are built
+ * into the test harness - notifications are recorded rather than shown, and
+ * commands are answered with canned output rather than spawned */
+
+#ifndef POWER_HARNESS_H
+#define POWER_HARNESS_H
+
+#include <stdio.h>
+#include <gtk/gtk.h>
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+typedef enum
+{
+    CONF_TYPE_NONE
+} conf_type_t;
+
+typedef struct
+{
+    conf_type_t type;
+    const char *name;
+    const char *label;
+    void *value;
+} conf_table_t;
+
+#define wrap_notify(panel,msg)                  harness_notify (msg, FALSE)
+#define wrap_critical(panel,msg)                harness_notify (msg, TRUE)
+#define wrap_set_taskbar_icon(pt,image,icon)    gtk_image_set_from_icon_name (GTK_IMAGE (image), icon, GTK_ICON_SIZE_BUTTON)
+#define wrap_show_menu(plugin,menu)             do { } while (0)
+#define is_pi()                                 harness_is_pi
+#define CHECK_LONGPRESS
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+extern gboolean harness_is_pi;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+extern void harness_notify (const char *msg, gboolean critical);
+extern int harness_system (const char *cmd);
+extern FILE *harness_popen (const char *cmd);
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,172 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#ifndef POWER_IPC_WIRE_H
+#define POWER_IPC_WIRE_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* State publication - the plugin listens on a SOCK_SEQPACKET socket in the
+ * user's runtime directory, and each datagram it sends is one batch: a batch
+ * header followed by a number of fixed-size records, all in host byte order.
+ * Clients can copy records straight out of the datagram. Every change made
+ * during one main loop iteration goes out in a single batch.
+ *
+ * Batches carry a sequence number which rises by one for each batch sent. On
+ * connection a client is sent a snapshot batch, whose sequence number is that
+ * of the last batch the snapshot includes. A client that falls too far behind
+ * is sent a new snapshot in place of the batches it missed, so a jump in the
+ * sequence number is always preceded by a snapshot; any other gap means state
+ * was lost and the client should reconnect.
+ *
+ * Any change to the layout of these structures must raise IPC_VERSION. */
+
+#define IPC_MAGIC           0x50495050      /* "PPIP" read as little-endian */
+#define IPC_VERSION         2
+#define IPC_SOCKET_NAME     "pplug-power.sock"
+#define IPC_BATCH_MAX       32              /* Records per batch */
+
+/* Record types */
+#define IPC_EVENT           1               /* A condition was raised */
+#define IPC_SNAPSHOT        2               /* Complete current state */
+#define IPC_DELTA           3               /* State after a change */
+
+/* Condition bits, as shown by the panel icon */
+#define IPC_COND_LOW_VOLTAGE    0x01
+#define IPC_COND_OVER_CURRENT   0x02
+#define IPC_COND_BROWNOUT       0x04
+
+/* Fields of IpcState, for the changed mask of a delta */
+#define IPC_F_CONDITIONS    0x01
+#define IPC_F_MAX_CURRENT   0x02
+#define IPC_F_POWER_RESET   0x04
+#define IPC_F_THROTTLED     0x08
+#define IPC_F_OC_TOTAL      0x10
+#define IPC_F_LV_TIME       0x20
+#define IPC_F_OC_TIME       0x40
+
+typedef struct
+{
+    uint32_t conditions;            /* IPC_COND_* bits currently set */
+    int32_t max_current;            /* PSU capability in mA, or -1 if not reported */
+    int32_t power_reset;            /* Firmware reset reason flags, or -1 if not reported */
+    int32_t throttled;              /* Firmware throttle flags, or -1 if not known */
+    int32_t oc_total;               /* Sum of port overcurrent counts */
+    uint32_t reserved;
+    int64_t lv_time;                /* Wall clock usec of the last low voltage event, or 0 */
+    int64_t oc_time;                /* Wall clock usec of the last overcurrent event, or 0 */
+} IpcState;
+
+typedef struct
+{
+    uint16_t type;                  /* IPC_EVENT, IPC_SNAPSHOT or IPC_DELTA */
+    uint16_t event;                 /* IPC_EVENT - the IPC_COND_* bit raised */
+    uint32_t changed;               /* IPC_DELTA - IPC_F_* fields changed by this record */
+    int64_t time;                   /* Wall clock usec */
+    IpcState state;                 /* State after the record */
+} IpcRecord;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;                 /* Records following the header */
+    uint64_t seq;
+} IpcBatchHeader;
+
+/* Full state - a client may send IPC_GET_STATE as a single 32-bit datagram
+ * at any time. It is answered with one IpcFullState datagram in place of any
+ * snapshot or batches still waiting for it. Pending changes are sent as a
+ * batch before the reply is taken, so seq names the last batch the reply
+ * includes and the client's stream carries on from the batch after it. The
+ * same structure backs the GetSnapshot D-Bus method. Everything in it comes
+ * from state the plugin already holds - asking for it reads nothing from
+ * sysfs.
+ *
+ * Any change to this layout must raise IPC_FULL_VERSION. */
+
+#define IPC_GET_STATE       0x54534750      /* "PGST" read as little-endian */
+#define IPC_FULL_MAGIC      0x4c465050      /* "PPFL" read as little-endian */
+#define IPC_FULL_VERSION    1
+#define IPC_PORTS_MAX       8
+
+typedef struct
+{
+    char name[24];                  /* Hub port, such as usb1-port2 */
+    int32_t count;                  /* Overcurrent count last seen */
+    uint32_t reserved;
+} IpcPort;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_ports;             /* Entries used in ports */
+    uint64_t seq;                   /* Last batch the state includes */
+    int64_t time;                   /* Wall clock usec when taken */
+    IpcState state;
+    int32_t power_mw;               /* Total rail power at the last reading, or -1 if not measured */
+    uint32_t reserved;
+    int64_t session_uwh;            /* Energy used since the panel started, or -1 */
+    int64_t day_uwh;                /* Energy used since midnight, or -1 */
+    IpcPort ports[IPC_PORTS_MAX];   /* Ports that have reported a count */
+} IpcFullState;
+
+/* Stream framing, for forwarding batches to an aggregator over TCP or a Unix
+ * stream socket - the connection opens with a hello naming the device and
+ * the boot it is running, then each batch is sent as a 32-bit length
+ * followed by the datagram unchanged */
+
+#define IPC_HELLO_MAGIC     0x47415050      /* "PPAG" read as little-endian */
+#define IPC_DEVICE_MAX      48
+#define IPC_BOOT_ID_LEN     16
+#define IPC_FRAME_MAX       (sizeof (IpcBatchHeader) + IPC_BATCH_MAX * sizeof (IpcRecord))
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;               /* IPC_VERSION of the batches that follow */
+    uint16_t reserved;
+    char device[IPC_DEVICE_MAX];    /* NUL-terminated device name */
+    uint8_t boot_id[IPC_BOOT_ID_LEN]; /* Kernel boot ID, or all zero if unknown */
+} IpcHello;
+
+_Static_assert (sizeof (IpcState) == 40, "IpcState layout");
+_Static_assert (sizeof (IpcRecord) == 56, "IpcRecord layout");
+_Static_assert (sizeof (IpcBatchHeader) == 16, "IpcBatchHeader layout");
+_Static_assert (sizeof (IpcPort) == 32, "IpcPort layout");
+_Static_assert (sizeof (IpcFullState) == 344, "IpcFullState layout");
+_Static_assert (sizeof (IpcHello) == 72, "IpcHello layout");
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,689 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* State publisher - clients connect to a SOCK_SEQPACKET socket and receive
+ * a snapshot, then a batch of records for each main loop iteration in which
+ * the published state changed. The wire format is in ipc-wire.h.
+ *
+ * Sending never blocks. Batches a client cannot take yet wait in a short
+ * queue of its own; if that fills, the queue is thrown away and the client
+ * is sent a fresh snapshot once it can read again, so a stuck client costs
+ * a fixed amount of memory and a slow one skips ahead rather than working
+ * through a backlog of stale changes.
+ *
+ * The full state, including the per-port overcurrent counts and energy
+ * totals that the stream does not carry, can be asked for over the same
+ * socket or with the GetSnapshot method on the session bus */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+
+#ifdef POWER_HARNESS
+#include "harness.h"
+#elif defined (LXPLUG)
+#include "plugin.h"
+#else
+#include "lxutils.h"
+#endif
+
+#include "budget.h"
+#include "power.h"
+#include "ipc.h"
+#include "ipc-wire.h"
+#include "energy.h"
+#include "stats.h"
+
+#ifdef IPC_PUBLISH
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* The batch being built and the queued batches come from the state clients'
+ * share of the memory budget - at the default 64 kB, four clients can each
+ * have two batches waiting */
+#define IPC_CLIENTS MAX (2, MIN (8, MEM_BUDGET_KB / 16))
+#define IPC_QUEUE   ((MEM_SHARE (MEM_IPC) - (int) sizeof (pending)) / IPC_CLIENTS / (int) sizeof (Batch))
+
+#define DBUS_NAME   "com.raspberrypi.PowerMonitor"
+#define DBUS_PATH   "/com/raspberrypi/PowerMonitor"
+#define DBUS_IFACE  "com.raspberrypi.PowerMonitor1"
+
+typedef struct
+{
+    guint64 seq;
+    int count;
+    IpcRecord recs[IPC_BATCH_MAX];
+} Batch;
+
+typedef struct
+{
+    int fd;                         /* -1 for a free slot */
+    guint id;
+    guint out_id;                   /* Waiting for the socket to be writable */
+    Batch *queue;
+    int head;
+    int len;
+    gboolean resync;                /* Queue overflowed - send a snapshot next */
+    gboolean want_full;             /* Asked for the full state */
+    guint64 sent_seq;               /* Last batch delivered */
+    guint64 dropped;                /* Batches discarded on overflow */
+    guint64 resyncs;
+    int max_len;
+} Client;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static PowerPlugin *ipc_pt;
+static char *sock_path;
+static int listen_fd = -1;
+static guint listen_id;
+static Client clients[IPC_CLIENTS];
+
+static IpcRecord pending[IPC_BATCH_MAX];
+static int num_pending;
+
+/* The full state lists every port the plugin keeps, and its total is theirs */
+_Static_assert (OC_PORTS <= IPC_PORTS_MAX, "ports kept do not fit the full state");
+
+_Static_assert (IPC_QUEUE >= 1 && sizeof (pending) + IPC_CLIENTS * IPC_QUEUE * sizeof (Batch) <= (gsize) MEM_SHARE (MEM_IPC),
+    "state client queues do not fit their share of the memory budget");
+static guint flush_id;
+static guint64 seq;                 /* Of the last batch sent */
+static guint64 total_dropped;       /* Over all clients, including those gone */
+static guint64 total_resyncs;
+
+static IpcState published;          /* State as of the last record queued */
+static IpcState flushed;            /* State as of the last batch sent */
+static gint64 last_lv, last_oc;     /* Wall clock times of the last events */
+
+static GDBusConnection *bus;
+static guint dbus_obj_id;
+static guint dbus_name_id;
+
+static const char introspection[] =
+    "<node>"
+    "  <interface name='" DBUS_IFACE "'>"
+    "    <method name='GetSnapshot'>"
+    "      <arg type='a{sv}' name='state' direction='out'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static void current_state (PowerPlugin *pt, IpcState *st);
+static guint32 changed_fields (const IpcState *a, const IpcState *b);
+static int send_batch (int fd, guint64 bseq, const IpcRecord *recs, int count);
+static int send_snapshot (int fd);
+static void full_state (IpcFullState *full);
+static int send_full (int fd);
+static void queue_record (int type, int event, guint32 changed, const IpcState *st);
+static void deliver (Client *c);
+static gboolean cb_writable (gint fd, GIOCondition, gpointer data);
+static void drop_client (Client *c);
+static void flush (void);
+static gboolean cb_flush (gpointer);
+static gboolean cb_client (gint fd, GIOCondition cond, gpointer data);
+static gboolean cb_accept (gint fd, GIOCondition, gpointer);
+static int open_socket (const char *path);
+static GVariant *full_state_variant (const IpcFullState *full);
+static void cb_method (GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *method,
+    GVariant *, GDBusMethodInvocation *inv, gpointer);
+static void dbus_start (GDBusConnection *conn);
+static void dbus_stop (void);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+static void current_state (PowerPlugin *pt, IpcState *st)
+{
+    memset (st, 0, sizeof (IpcState));
+    st->conditions = pt->show_icon;
+    st->max_current = pt->max_current;
+    st->power_reset = pt->power_reset;
+    st->throttled = pt->throttled;
+    st->oc_total = pt->oc_total;
+    st->lv_time = last_lv;
+    st->oc_time = last_oc;
+}
+
+static guint32 changed_fields (const IpcState *a, const IpcState *b)
+{
+    guint32 changed = 0;
+
+    if (a->conditions != b->conditions) changed |= IPC_F_CONDITIONS;
+    if (a->max_current != b->max_current) changed |= IPC_F_MAX_CURRENT;
+    if (a->power_reset != b->power_reset) changed |= IPC_F_POWER_RESET;
+    if (a->throttled != b->throttled) changed |= IPC_F_THROTTLED;
+    if (a->oc_total != b->oc_total) changed |= IPC_F_OC_TOTAL;
+    if (a->lv_time != b->lv_time) changed |= IPC_F_LV_TIME;
+    if (a->oc_time != b->oc_time) changed |= IPC_F_OC_TIME;
+    return changed;
+}
+
+/* One datagram per batch, never blocking - returns 1 if sent, 0 if the
+ * client cannot take it yet, or -1 if the client has gone */
+static int send_batch (int fd, guint64 bseq, const IpcRecord *recs, int count)
+{
+    IpcBatchHeader hdr;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    hdr.magic = IPC_MAGIC;
+    hdr.version = IPC_VERSION;
+    hdr.count = count;
+    hdr.seq = bseq;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof (hdr);
+    iov[1].iov_base = (void *) recs;
+    iov[1].iov_len = count * sizeof (IpcRecord);
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (sendmsg (fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) return 1;
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+}
+
+/* The state as of the last batch sent, carrying that batch's number */
+static int send_snapshot (int fd)
+{
+    IpcRecord rec;
+
+    memset (&rec, 0, sizeof (rec));
+    rec.type = IPC_SNAPSHOT;
+    rec.time = g_get_real_time ();
+    rec.state = flushed;
+    return send_batch (fd, seq, &rec, 1);
+}
+
+/* Everything known, from cached state only - changes not yet published are
+ * queued, and pending changes go out first, so that the state is exactly that
+ * after batch seq and agrees with the ports listed */
+static void full_state (IpcFullState *full)
+{
+    int i;
+
+    ipc_publish (ipc_pt, 0);
+    flush ();
+
+    memset (full, 0, sizeof (IpcFullState));
+    full->magic = IPC_FULL_MAGIC;
+    full->version = IPC_FULL_VERSION;
+    full->seq = seq;
+    full->time = g_get_real_time ();
+    full->state = flushed;
+
+    for (i = 0; i < ipc_pt->num_oc_ports && i < IPC_PORTS_MAX; i++)
+    {
+        g_strlcpy (full->ports[i].name, ipc_pt->oc_ports[i].name, sizeof (full->ports[i].name));
+        full->ports[i].count = ipc_pt->oc_ports[i].count;
+    }
+    full->num_ports = i;
+
+    full->state.oc_total = 0;
+    for (i = 0; i < full->num_ports; i++) full->state.oc_total += full->ports[i].count;
+
+    full->power_mw = -1;
+    full->session_uwh = full->day_uwh = -1;
+#ifdef ENERGY_MONITOR
+    {
+        double watts, session, day;
+
+        if (energy_totals (&watts, &session, &day))
+        {
+            if (watts >= 0.0) full->power_mw = watts * 1000.0 + 0.5;
+            full->session_uwh = session * 1e6 + 0.5;
+            full->day_uwh = day * 1e6 + 0.5;
+        }
+    }
+#endif
+}
+
+static int send_full (int fd)
+{
+    IpcFullState full;
+
+    full_state (&full);
+    if (send (fd, &full, sizeof (full), MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) return 1;
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+}
+
+static void queue_record (int type, int event, guint32 changed, const IpcState *st)
+{
+    IpcRecord *rec;
+
+    if (num_pending == IPC_BATCH_MAX) flush ();
+
+    rec = &pending[num_pending++];
+    rec->type = type;
+    rec->event = event;
+    rec->changed = changed;
+    rec->time = g_get_real_time ();
+    rec->state = *st;
+
+    if (!flush_id) flush_id = POWER_IDLE_ADD (cb_flush, NULL);
+}
+
+/* Send the latest batch, or queue it behind any the client has yet to take */
+static void deliver (Client *c)
+{
+    Batch *b;
+    int res;
+
+    /* The snapshot or full state to come will include this batch */
+    if (c->resync || c->want_full) return;
+
+    if (!c->len)
+    {
+        res = send_batch (c->fd, seq, pending, num_pending);
+        if (res > 0) c->sent_seq = seq;
+        if (res < 0) drop_client (c);
+        if (res) return;
+    }
+
+    if (c->len == IPC_QUEUE)
+    {
+        c->dropped += c->len + 1;
+        c->resyncs++;
+        total_dropped += c->len + 1;
+        total_resyncs++;
+        c->len = 0;
+        c->resync = TRUE;
+    }
+    else
+    {
+        b = &c->queue[(c->head + c->len++) % IPC_QUEUE];
+        b->seq = seq;
+        b->count = num_pending;
+        memcpy (b->recs, pending, num_pending * sizeof (IpcRecord));
+        if (c->len > c->max_len) c->max_len = c->len;
+    }
+
+    if (!c->out_id) c->out_id = POWER_FD_ADD (c->fd, G_IO_OUT, cb_writable, c);
+}
+
+static gboolean cb_writable (gint fd, GIOCondition, gpointer data)
+{
+    Client *c = (Client *) data;
+    Batch *b;
+    int res;
+
+    if (c->want_full)
+    {
+        res = send_full (fd);
+        if (res == 0) return G_SOURCE_CONTINUE;
+        if (res < 0)
+        {
+            c->out_id = 0;
+            drop_client (c);
+            return G_SOURCE_REMOVE;
+        }
+
+        /* The reply covers anything that was waiting */
+        c->want_full = FALSE;
+        c->resync = FALSE;
+        c->len = 0;
+        c->sent_seq = seq;
+    }
+
+    if (c->resync)
+    {
+        res = send_snapshot (fd);
+        if (res == 0) return G_SOURCE_CONTINUE;
+        if (res < 0)
+        {
+            c->out_id = 0;
+            drop_client (c);
+            return G_SOURCE_REMOVE;
+        }
+        c->resync = FALSE;
+        c->sent_seq = seq;
+    }
+
+    while (c->len)
+    {
+        b = &c->queue[c->head];
+        res = send_batch (fd, b->seq, b->recs, b->count);
+        if (res == 0) return G_SOURCE_CONTINUE;
+        if (res < 0)
+        {
+            c->out_id = 0;
+            drop_client (c);
+            return G_SOURCE_REMOVE;
+        }
+        c->sent_seq = b->seq;
+        c->head = (c->head + 1) % IPC_QUEUE;
+        c->len--;
+    }
+
+    c->out_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void drop_client (Client *c)
+{
+    if (c->fd < 0) return;
+    g_debug ("power: state client left %" G_GUINT64_FORMAT " batches behind, dropped %" G_GUINT64_FORMAT
+        " in %" G_GUINT64_FORMAT " resyncs, queued at most %d", seq - c->sent_seq, c->dropped, c->resyncs, c->max_len);
+
+    if (c->id) g_source_remove (c->id);
+    if (c->out_id) g_source_remove (c->out_id);
+    close (c->fd);
+    g_free (c->queue);
+    memset (c, 0, sizeof (Client));
+    c->fd = -1;
+}
+
+static void flush (void)
+{
+    int i;
+
+    if (flush_id) g_source_remove (flush_id);
+    flush_id = 0;
+    if (!num_pending) return;
+
+    seq++;
+    flushed = pending[num_pending - 1].state;
+    for (i = 0; i < IPC_CLIENTS; i++)
+        if (clients[i].fd >= 0) deliver (&clients[i]);
+    num_pending = 0;
+}
+
+static gboolean cb_flush (gpointer)
+{
+    flush_id = 0;
+    flush ();
+    return G_SOURCE_REMOVE;
+}
+
+/* The only thing a client can ask for is the full state - anything else
+ * readable is ignored, and a hangup drops the client */
+static gboolean cb_client (gint fd, GIOCondition cond, gpointer data)
+{
+    Client *c = (Client *) data;
+    char buf[64];
+    guint32 req;
+    ssize_t n = 0;
+
+    if (!(cond & (G_IO_HUP | G_IO_ERR))) n = recv (fd, buf, sizeof (buf), MSG_DONTWAIT);
+    if (n <= 0)
+    {
+        c->id = 0;
+        drop_client (c);
+        return G_SOURCE_REMOVE;
+    }
+
+    memcpy (&req, buf, sizeof (req));
+    if (n == sizeof (req) && req == IPC_GET_STATE)
+    {
+        c->want_full = TRUE;
+        if (!c->out_id) c->out_id = POWER_FD_ADD (fd, G_IO_OUT, cb_writable, c);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean cb_accept (gint fd, GIOCondition, gpointer)
+{
+    Client *c;
+    int cfd, i;
+
+    cfd = accept4 (fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd < 0) return G_SOURCE_CONTINUE;
+
+    for (i = 0; i < IPC_CLIENTS; i++)
+        if (clients[i].fd < 0) break;
+    if (i == IPC_CLIENTS)
+    {
+        close (cfd);
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* A new client starts out wanting a snapshot */
+    c = &clients[i];
+    c->fd = cfd;
+    c->queue = g_new (Batch, IPC_QUEUE);
+    c->sent_seq = seq;
+    c->resync = TRUE;
+    c->id = POWER_FD_ADD (cfd, G_IO_IN | G_IO_HUP | G_IO_ERR, cb_client, c);
+    c->out_id = POWER_FD_ADD (cfd, G_IO_OUT, cb_writable, c);
+    return G_SOURCE_CONTINUE;
+}
+
+void ipc_publish (PowerPlugin *pt, int cond)
+{
+    IpcState st;
+    guint32 changed;
+
+    /* Only the instance that opened the socket publishes */
+    if (listen_fd < 0 || pt != ipc_pt) return;
+
+    if (cond & IPC_COND_LOW_VOLTAGE) last_lv = g_get_real_time ();
+    if (cond & IPC_COND_OVER_CURRENT) last_oc = g_get_real_time ();
+    current_state (pt, &st);
+
+    if (cond) queue_record (IPC_EVENT, cond, 0, &st);
+    changed = changed_fields (&published, &st);
+    if (changed) queue_record (IPC_DELTA, 0, changed, &st);
+    published = st;
+}
+
+static int open_socket (const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (addr.sun_path)) return -1;
+    strcpy (addr.sun_path, path);
+
+    fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    /* Another panel may already be publishing; otherwise the socket is stale */
+    if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0 || (errno != ECONNREFUSED && errno != ENOENT))
+    {
+        g_debug ("power: state already published at %s", path);
+        close (fd);
+        return -1;
+    }
+    unlink (path);
+
+    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (fd, IPC_CLIENTS) < 0)
+    {
+        g_warning ("power: cannot publish state at %s - %s", path, g_strerror (errno));
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* The wire structure, plus how far behind each client is - batches not yet
+ * sent, dropped and resyncs, then the current and longest queue */
+static GVariant *full_state_variant (const IpcFullState *full)
+{
+    GVariantBuilder b, ports, lag;
+    int i;
+
+    g_variant_builder_init (&ports, G_VARIANT_TYPE ("a(si)"));
+    for (i = 0; i < full->num_ports; i++)
+        g_variant_builder_add (&ports, "(si)", full->ports[i].name, full->ports[i].count);
+
+    g_variant_builder_init (&lag, G_VARIANT_TYPE ("a(tttii)"));
+    for (i = 0; i < IPC_CLIENTS; i++)
+        if (clients[i].fd >= 0)
+            g_variant_builder_add (&lag, "(tttii)", seq - clients[i].sent_seq, clients[i].dropped, clients[i].resyncs,
+                clients[i].len, clients[i].max_len);
+
+    g_variant_builder_init (&b, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&b, "{sv}", "version", g_variant_new_uint32 (full->version));
+    g_variant_builder_add (&b, "{sv}", "seq", g_variant_new_uint64 (full->seq));
+    g_variant_builder_add (&b, "{sv}", "time", g_variant_new_int64 (full->time));
+    g_variant_builder_add (&b, "{sv}", "conditions", g_variant_new_uint32 (full->state.conditions));
+    g_variant_builder_add (&b, "{sv}", "max_current", g_variant_new_int32 (full->state.max_current));
+    g_variant_builder_add (&b, "{sv}", "power_reset", g_variant_new_int32 (full->state.power_reset));
+    g_variant_builder_add (&b, "{sv}", "throttled", g_variant_new_int32 (full->state.throttled));
+    g_variant_builder_add (&b, "{sv}", "oc_total", g_variant_new_int32 (full->state.oc_total));
+    g_variant_builder_add (&b, "{sv}", "lv_time", g_variant_new_int64 (full->state.lv_time));
+    g_variant_builder_add (&b, "{sv}", "oc_time", g_variant_new_int64 (full->state.oc_time));
+    g_variant_builder_add (&b, "{sv}", "ports", g_variant_builder_end (&ports));
+    g_variant_builder_add (&b, "{sv}", "power_mw", g_variant_new_int32 (full->power_mw));
+    g_variant_builder_add (&b, "{sv}", "session_uwh", g_variant_new_int64 (full->session_uwh));
+    g_variant_builder_add (&b, "{sv}", "day_uwh", g_variant_new_int64 (full->day_uwh));
+    g_variant_builder_add (&b, "{sv}", "clients", g_variant_builder_end (&lag));
+    g_variant_builder_add (&b, "{sv}", "dropped", g_variant_new_uint64 (total_dropped));
+    g_variant_builder_add (&b, "{sv}", "resyncs", g_variant_new_uint64 (total_resyncs));
+    return g_variant_new ("(a{sv})", &b);
+}
+
+static void cb_method (GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *method,
+    GVariant *, GDBusMethodInvocation *inv, gpointer)
+{
+    IpcFullState full;
+
+    STAT_DISPATCH_BEGIN ();
+    if (strcmp (method, "GetSnapshot"))
+        g_dbus_method_invocation_return_error (inv, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD, "No method %s", method);
+    else
+    {
+        full_state (&full);
+        g_dbus_method_invocation_return_value (inv, full_state_variant (&full));
+    }
+    STAT_DISPATCH_END ();
+}
+
+static void dbus_start (GDBusConnection *conn)
+{
+    static const GDBusInterfaceVTable vtable = { .method_call = cb_method };
+    GDBusNodeInfo *node;
+
+    if (!conn) return;
+    node = g_dbus_node_info_new_for_xml (introspection, NULL);
+    if (!node) return;
+
+    dbus_obj_id = g_dbus_connection_register_object (conn, DBUS_PATH, node->interfaces[0], &vtable, NULL, NULL, NULL);
+    g_dbus_node_info_unref (node);
+    if (!dbus_obj_id) return;
+
+    bus = g_object_ref (conn);
+    dbus_name_id = g_bus_own_name_on_connection (bus, DBUS_NAME, G_BUS_NAME_OWNER_FLAGS_NONE, NULL, NULL, NULL, NULL);
+}
+
+static void dbus_stop (void)
+{
+    if (dbus_name_id) g_bus_unown_name (dbus_name_id);
+    dbus_name_id = 0;
+    if (dbus_obj_id) g_dbus_connection_unregister_object (bus, dbus_obj_id);
+    dbus_obj_id = 0;
+    g_clear_object (&bus);
+}
+
+void ipc_start (PowerPlugin *pt)
+{
+    int i;
+
+    if (listen_fd >= 0) return;
+    for (i = 0; i < IPC_CLIENTS; i++) clients[i].fd = -1;
+
+    sock_path = g_build_filename (g_get_user_runtime_dir (), IPC_SOCKET_NAME, NULL);
+    listen_fd = open_socket (sock_path);
+    if (listen_fd < 0)
+    {
+        g_free (sock_path);
+        sock_path = NULL;
+        return;
+    }
+
+    ipc_pt = pt;
+    current_state (pt, &published);
+    flushed = published;
+    listen_id = POWER_FD_ADD (listen_fd, G_IO_IN, cb_accept, NULL);
+    dbus_start (pt->session_bus);
+}
+
+/* The session bus connection is made asynchronously, so may arrive after the
+ * socket is already open */
+void ipc_bus_ready (GDBusConnection *conn)
+{
+    if (listen_fd >= 0 && !bus) dbus_start (conn);
+}
+
+/* The batch being built and the queues of the clients connected */
+gsize ipc_memory (void)
+{
+    gsize total = sizeof (pending);
+    int i;
+
+    for (i = 0; i < IPC_CLIENTS; i++)
+        if (clients[i].queue) total += IPC_QUEUE * sizeof (Batch);
+    return total;
+}
+
+/* A second instance of the plugin finds the socket already open and does not
+ * publish, so its going must leave the first instance's server alone */
+void ipc_stop (PowerPlugin *pt)
+{
+    int i;
+
+    if (listen_fd < 0 || pt != ipc_pt) return;
+
+    dbus_stop ();
+    if (flush_id) g_source_remove (flush_id);
+    flush_id = 0;
+    num_pending = 0;
+    for (i = 0; i < IPC_CLIENTS; i++) drop_client (&clients[i]);
+
+    g_source_remove (listen_id);
+    listen_id = 0;
+    close (listen_fd);
+    listen_fd = -1;
+    unlink (sock_path);
+    g_free (sock_path);
+    sock_path = NULL;
+    ipc_pt = NULL;
+}
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -26,30 +26,83 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
 #include <locale.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
 #include <glib/gi18n.h>
 #include <glib-unix.h>
+#include <gio/gio.h>
+#include <sys/socket.h>
 #include <libudev.h>
 
-#ifdef LXPLUG
+#ifdef POWER_HARNESS
+#include "harness.h"
+#elif defined (LXPLUG)
 #include "plugin.h"
 #else
 #include "lxutils.h"
 #endif
 
+#include "budget.h"
 #include "power.h"
+#include "stats.h"
+#include "replay.h"
+#include "trace.h"
+#include "energy.h"
+#include "attrib.h"
+#include "ipc.h"
+#include "uevent-file.h"
 
 /*----------------------------------------------------------------------------*/
 /* Typedefs and macros                                                        */
 /*----------------------------------------------------------------------------*/
 
 #define POWER_PATH "/proc/device-tree/chosen/power/"
+#define THROTTLED_ATTR "get_throttled"
 #define WARN_FILE  "/proc/device-tree/chosen/user-warnings"
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+#define HWMON_CLASS "/sys/class/hwmon"
+
+/* Record of the user warnings already shown during this boot */
+#define WARN_STATE_DIR  "pplug-power"
+#define WARN_STATE_FILE "warnings.ini"
 
 /* Reasons to show the icon */
 #define ICON_LOW_VOLTAGE    0x01
 #define ICON_OVER_CURRENT   0x02
 #define ICON_BROWNOUT       0x04
 
+/* Firmware throttle flag for undervoltage having occurred since boot */
+#define THROTTLE_UV_OCCURRED 0x10000
+
+/* The test harness substitutes virtual time, a fixture filesystem and canned
+ * output for the commands the checks run */
+#ifdef POWER_HARNESS
+#define POWER_NOW()         scenario_now ()
+#define FIXTURE(path)       scenario_path (path)
+#define SYSTEM(cmd)         harness_system (cmd)
+#define POPEN(cmd)          harness_popen (cmd)
+#define PCLOSE(fp)          fclose (fp)
+#else
+#define POWER_NOW()         g_get_monotonic_time ()
+#define FIXTURE(path)       (path)
+#define SYSTEM(cmd)         system (cmd)
+#define POPEN(cmd)          popen (cmd, "r")
+#define PCLOSE(fp)          pclose (fp)
+#endif
+
+/* Time since an event's monotonic timestamp in usec, skipped for events without one */
+#define EVENT_LATENCY(id,since) do { if (since) STAT_HIST (id, (POWER_NOW () - (since)) * 1000); } while (0)
+
+#ifdef KMSG_MONITOR
+#define KMSG_PATH "/dev/kmsg"
+#define KMSG_RECORD_MAX 8192        /* Kernel CONSOLE_EXT_LOG_MAX */
+
+/* Suppress a repeat alarm of the same kind from another source within this time */
+#define DEDUP_WINDOW        (10 * G_USEC_PER_SEC)
+#endif
+
 /*----------------------------------------------------------------------------*/
 /* Global data                                                                */
 /*----------------------------------------------------------------------------*/
@@ -58,20 +111,62 @@ conf_table_t conf_table[1] = {
     {CONF_TYPE_NONE, NULL, NULL, NULL}
 };
 
+_Static_assert (sizeof (PowerPlugin) <= (gsize) MEM_SHARE (MEM_HISTORY + 1), "PowerPlugin does not fit its share of the memory budget");
+
+static gboolean locale_bound = FALSE;
+
+#ifdef POWER_INSTRUMENT
+static gint64 load_time;            /* Monotonic time the module was loaded */
+#endif
+
 /*----------------------------------------------------------------------------*/
 /* Prototypes                                                                 */
 /*----------------------------------------------------------------------------*/
 
 static void check_psu (PowerPlugin *pt);
 static void check_brownout (PowerPlugin *pt);
+static guint64 fingerprint (const char *data, size_t len);
+static gboolean read_boot_id (char *buf, size_t size);
 static void check_user_warnings (PowerPlugin *pt);
 static char *get_string (char *cmd);
 static void check_memres (PowerPlugin *pt, int mem);
 static gboolean startup_checks (gpointer data);
 static gboolean cb_overcurrent_fd (gint, GIOCondition, gpointer data);
 static gboolean cb_lowvoltage_fd (gint, GIOCondition, gpointer data);
+static void fill_uevent (PowerUevent *ev, struct udev_device *dev);
+static int read_alarm (const PowerUevent *ev, const char *fmt, const char *arg);
+static gboolean handle_overcurrent (PowerPlugin *pt, const PowerUevent *ev);
+static gboolean handle_lowvoltage (PowerPlugin *pt, const PowerUevent *ev);
+static void alarm_low_voltage (PowerPlugin *pt, gint64 since);
+static void alarm_over_current (PowerPlugin *pt, gint64 since);
+#ifdef KMSG_MONITOR
+static gboolean cb_kmsg_fd (gint fd, GIOCondition, gpointer data);
+#endif
+static int read_sysfs_int (const char *dir, const char *attr, int base);
+static void set_port_count (PowerPlugin *pt, const char *port, int count);
+static int read_oc_total (PowerPlugin *pt);
+static int read_throttled (PowerPlugin *pt);
+static void resync_state (PowerPlugin *pt);
+static void prepare_sleep (PowerPlugin *pt, gboolean sleeping);
+static void cb_prepare_sleep (GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *params, gpointer data);
+static void cb_system_bus (GObject *, GAsyncResult *res, gpointer data);
+static void cb_screensaver (GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *params, gpointer data);
+static void cb_screensaver_state (GObject *source, GAsyncResult *res, gpointer data);
+static void cb_session_bus (GObject *, GAsyncResult *res, gpointer data);
+static void set_background (PowerPlugin *pt, gboolean background);
 static void update_icon (PowerPlugin *pt);
-static void show_info (GtkWidget *, gpointer);
+static void report_memory (void);
+static PowerEvent *add_history (PowerPlugin *pt, int type);
+static void append_procs (GString *str, const char *label, const PowerProc *procs, gboolean io);
+static void info_add_section (GtkWidget *box, const char *title, const char *text);
+static void show_info (GtkWidget *, gpointer data);
+#ifdef POWER_INSTRUMENT
+static void show_stats (GtkWidget *, gpointer data);
+static gboolean cb_first_frame (gpointer);
+static void cb_before_paint (GdkFrameClock *, gpointer data);
+static void cb_after_paint (GdkFrameClock *, gpointer data);
+static void watch_frames (GtkWidget *widget, gpointer data);
+#endif
 static void power_button_clicked (GtkWidget *, PowerPlugin *pt);
 
 /*----------------------------------------------------------------------------*/
@@ -82,9 +177,10 @@ static void power_button_clicked (GtkWidget *, PowerPlugin *pt);
 
 static void check_psu (PowerPlugin *pt)
 {
-    if (system ("raspi-config nonint is_cmfive") == 0) return;
+    STAT_SPAWN ();
+    if (SYSTEM ("raspi-config nonint is_cmfive") == 0) return;
 
-    FILE *fp = fopen (POWER_PATH "max_current", "rb");
+    FILE *fp = fopen (FIXTURE (POWER_PATH "max_current"), "rb");
     int val;
 
     if (fp)
@@ -92,53 +188,173 @@ static void check_psu (PowerPlugin *pt)
         unsigned char *cptr = (unsigned char *) &val;
         // you're kidding, right?
         for (int i = 3; i >= 0; i--) cptr[i] = fgetc (fp);
-        if (val < 5000) wrap_notify (pt->panel, _("This power supply is not capable of supplying 5A\nPower to peripherals will be restricted"));
+        pt->max_current = val;
+        if (val < 5000)
+        {
+            TRACE1 (notification_sent, "power supply");
+            STAT_COUNT (COUNT_NOTIFY);
+            wrap_notify (pt->panel, _("This power supply is not capable of supplying 5A\nPower to peripherals will be restricted"));
+        }
         fclose (fp);
+        IPC_CHANGED (pt, 0);
     }
 }
 
 static void check_brownout (PowerPlugin *pt)
 {
-    FILE *fp = fopen (POWER_PATH "power_reset", "rb");
+    FILE *fp = fopen (FIXTURE (POWER_PATH "power_reset"), "rb");
+    PowerEvent *ev;
     int val;
 
     if (fp)
     {
         unsigned char *cptr = (unsigned char *) &val;
         for (int i = 3; i >= 0; i--) cptr[i] = fgetc (fp);
+        pt->power_reset = val;
         if (val & 0x02)
         {
+            TRACE1 (condition_set, ICON_BROWNOUT);
+            TRACE1 (notification_sent, "brownout");
+            STAT_COUNT (COUNT_NOTIFY);
             wrap_critical (pt->panel, _("Reset due to low power event\nPlease check your power supply"));
             pt->show_icon |= ICON_BROWNOUT;
+            ev = add_history (pt, ICON_BROWNOUT);
             update_icon (pt);
+
+            /* The load that browned out the last boot is gone, but what starts with
+             * the desktop is often what brings it back */
+            attrib_start (ev);
         }
         fclose (fp);
+        IPC_CHANGED (pt, val & 0x02 ? ICON_BROWNOUT : 0);
     }
 }
 
+/* 64-bit FNV-1a, for the warnings file and each line in it */
+static guint64 fingerprint (const char *data, size_t len)
+{
+    guint64 hash = 0xcbf29ce484222325ULL;
+
+    while (len--)
+    {
+        hash ^= (unsigned char) *data++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static gboolean read_boot_id (char *buf, size_t size)
+{
+    ssize_t len;
+    int fd;
+
+    fd = open (FIXTURE (BOOT_ID_FILE), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+    len = read (fd, buf, size - 1);
+    close (fd);
+    if (len <= 0) return FALSE;
+    buf[len] = 0;
+    g_strchomp (buf);
+    return TRUE;
+}
+
+/* The warnings only change at boot, but the panel can be restarted many times
+ * in one boot, so the warnings shown are recorded against the boot id. If the
+ * file is unchanged nothing is parsed; otherwise only lines not already shown
+ * are notified */
 static void check_user_warnings (PowerPlugin *pt)
 {
-    if (!access (WARN_FILE, F_OK))
+    char boot_id[40], hex[17], *buf, *line, *end, *next, *path, *str, **shown = NULL;
+    GKeyFile *kf;
+    GPtrArray *seen;
+    guint64 file_hash, hash;
+    gboolean have_boot, same_boot;
+    ssize_t len = 0, got;
+    int fd;
+
+    fd = open (FIXTURE (WARN_FILE), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    buf = g_malloc (WARN_FILE_MAX + 1);
+    while (len < WARN_FILE_MAX && (got = read (fd, buf + len, WARN_FILE_MAX - len)) > 0) len += got;
+    close (fd);
+    buf[len] = 0;
+    file_hash = fingerprint (buf, len);
+
+    path = g_build_filename (g_get_user_state_dir (), WARN_STATE_DIR, WARN_STATE_FILE, NULL);
+    kf = g_key_file_new ();
+    g_key_file_load_from_file (kf, path, G_KEY_FILE_NONE, NULL);
+    str = g_key_file_get_string (kf, "warnings", "boot_id", NULL);
+    have_boot = read_boot_id (boot_id, sizeof (boot_id));
+    same_boot = have_boot && !g_strcmp0 (str, boot_id);
+    g_free (str);
+
+    if (same_boot)
     {
-        FILE *fp = fopen (WARN_FILE, "rb");
-        if (fp)
+        str = g_key_file_get_string (kf, "warnings", "fingerprint", NULL);
+        if (str && g_ascii_strtoull (str, NULL, 16) == file_hash)
         {
-            char *buf = NULL;
-            size_t siz = 0;
-            while (getline (&buf, &siz, fp) != -1)
-                wrap_notify (pt->panel, g_strstrip (buf));
-            free (buf);
-            fclose (fp);
+            g_free (str);
+            g_key_file_free (kf);
+            g_free (path);
+            g_free (buf);
+            return;
         }
+        g_free (str);
+        shown = g_key_file_get_string_list (kf, "warnings", "shown", NULL, NULL);
+    }
+
+    /* Lines are split and trimmed in place */
+    seen = g_ptr_array_new_with_free_func (g_free);
+    for (line = buf; line < buf + len; line = next)
+    {
+        end = memchr (line, '\n', buf + len - line);
+        if (!end && len == WARN_FILE_MAX) break;    /* Truncated last line */
+        next = end ? end + 1 : buf + len;
+        if (!end) end = buf + len;
+
+        while (line < end && g_ascii_isspace (*line)) line++;
+        while (end > line && g_ascii_isspace (end[-1])) end--;
+        if (line == end) continue;
+        *end = 0;
+
+        hash = fingerprint (line, end - line);
+        g_snprintf (hex, sizeof (hex), "%016" G_GINT64_MODIFIER "x", hash);
+        g_ptr_array_add (seen, g_strdup (hex));
+        if (shown && g_strv_contains ((const char * const *) shown, hex)) continue;
+
+        TRACE1 (notification_sent, "user warning");
+        STAT_COUNT (COUNT_NOTIFY);
+        wrap_notify (pt->panel, line);
+    }
+
+    /* Record what has now been shown for this boot */
+    if (have_boot)
+    {
+        g_snprintf (hex, sizeof (hex), "%016" G_GINT64_MODIFIER "x", file_hash);
+        g_key_file_set_string (kf, "warnings", "boot_id", boot_id);
+        g_key_file_set_string (kf, "warnings", "fingerprint", hex);
+        g_key_file_set_string_list (kf, "warnings", "shown", (const char * const *) seen->pdata, seen->len);
+        str = g_path_get_dirname (path);
+        g_mkdir_with_parents (str, 0700);
+        g_free (str);
+        g_key_file_save_to_file (kf, path, NULL);
     }
+
+    g_strfreev (shown);
+    g_ptr_array_free (seen, TRUE);
+    g_key_file_free (kf);
+    g_free (path);
+    g_free (buf);
 }
 
 static char *get_string (char *cmd)
 {
     char *line = NULL, *res = NULL;
     size_t len = 0;
-    FILE *fp = popen (cmd, "r");
+    FILE *fp;
 
+    STAT_SPAWN ();
+    fp = POPEN (cmd);
     if (fp == NULL) return NULL;
     if (getline (&line, &len, fp) > 0)
     {
@@ -150,7 +366,7 @@ static char *get_string (char *cmd)
         }
         res = g_strdup (line);
     }
-    pclose (fp);
+    PCLOSE (fp);
     g_free (line);
     return res;
 }
@@ -182,7 +398,11 @@ static void check_memres (PowerPlugin *pt, int mem)
     }
 
     if (max_h > RES_HEIGHT_THRESHOLD)
+    {
+        TRACE1 (notification_sent, "memory");
+        STAT_COUNT (COUNT_NOTIFY);
         wrap_notify (pt->panel, _("High display resolution is using large amounts of memory.\nConsider reducing screen resolution."));
+    }
 }
 
 /* Monitoring callbacks */
@@ -193,17 +413,30 @@ static gboolean startup_checks (gpointer data)
     char *res;
     int mem = 0;
 
+#ifdef POWER_INSTRUMENT
+    gint64 start = stats_now_ns ();
+#endif
     res = get_string ("vcgencmd get_config total_mem | cut -d = -f 2");
+    STAT_HIST (HIST_FIRMWARE_QUERY, stats_now_ns () - start);
     if (res)
     {
         if (sscanf (res, "%d", &mem) != 1) mem = 0;
         g_free (res);
     }
 
-    check_psu (pt);
-    check_brownout (pt);
-    check_memres (pt, mem);
-    check_user_warnings (pt);
+    TRACE1 (startup_phase, "checks");
+    STAT_CALL (STAT_CHECK_PSU, check_psu (pt));
+    STAT_CALL (STAT_CHECK_BROWNOUT, check_brownout (pt));
+    STAT_CALL (STAT_CHECK_MEMRES, check_memres (pt, mem));
+    STAT_CALL (STAT_CHECK_USER_WARNINGS, check_user_warnings (pt));
+
+    /* Counts and flags from before the plugin started are not new, so are not
+     * alarmed on resume */
+    read_oc_total (pt);
+    pt->throttled = read_throttled (pt);
+    IPC_CHANGED (pt, 0);
+    report_memory ();
+    TRACE1 (startup_phase, "checks done");
 
     pt->startup_id = 0;
     return G_SOURCE_REMOVE;
@@ -212,36 +445,18 @@ static gboolean startup_checks (gpointer data)
 static gboolean cb_overcurrent_fd (gint, GIOCondition, gpointer data)
 {
     PowerPlugin *pt = (PowerPlugin *) data;
-    int val;
     struct udev_device *dev;
-    FILE *fp;
-    char *path;
+    PowerUevent ev;
 
+    STAT_BEGIN (STAT_CB_OVERCURRENT);
     dev = udev_monitor_receive_device (pt->udev_mon_oc);
     if (dev)
     {
-        if (!g_strcmp0 (udev_device_get_action (dev), "change"))
-        {
-            path = g_strdup_printf ("/sys/%s/disable", udev_device_get_property_value (dev, "OVER_CURRENT_PORT"));
-            fp = fopen (path, "rb");
-            if (fp)
-            {
-                if (fgetc (fp) == 0x31)
-                {
-                    if (sscanf (udev_device_get_property_value (dev, "OVER_CURRENT_COUNT"), "%d", &val) == 1 && val != pt->last_oc)
-                    {
-                        wrap_critical (pt->panel, _("USB overcurrent\nPlease check your connected USB devices"));
-                        pt->show_icon |= ICON_OVER_CURRENT;
-                        update_icon (pt);
-                        pt->last_oc = val;
-                    }
-                }
-                fclose (fp);
-            }
-            g_free (path);
-        }
+        fill_uevent (&ev, dev);
+        power_uevent (pt, &ev);
         udev_device_unref (dev);
     }
+    STAT_END (STAT_CB_OVERCURRENT);
 
     return G_SOURCE_CONTINUE;
 }
@@ -250,61 +465,807 @@ static gboolean cb_lowvoltage_fd (gint, GIOCondition, gpointer data)
 {
     PowerPlugin *pt = (PowerPlugin *) data;
     struct udev_device *dev;
-    FILE *fp;
-    char *path;
+    PowerUevent ev;
 
+    STAT_BEGIN (STAT_CB_LOWVOLTAGE);
     dev = udev_monitor_receive_device (pt->udev_mon_lv);
     if (dev)
     {
-        if (!g_strcmp0 (udev_device_get_action (dev), "change") && !strncmp (udev_device_get_sysname (dev), "hwmon", 5))
+        fill_uevent (&ev, dev);
+        power_uevent (pt, &ev);
+        udev_device_unref (dev);
+    }
+    STAT_END (STAT_CB_LOWVOLTAGE);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Uevent handlers - shared by the udev monitors and by replay of recorded
+ * events. A recorded event carries the alarm attribute as it was read at
+ * the time, which is used in place of the live sysfs value */
+
+static void fill_uevent (PowerUevent *ev, struct udev_device *dev)
+{
+    ev->action = udev_device_get_action (dev);
+    ev->subsystem = udev_device_get_subsystem (dev);
+    ev->devpath = udev_device_get_devpath (dev);
+    ev->oc_port = udev_device_get_property_value (dev, "OVER_CURRENT_PORT");
+    ev->oc_count = udev_device_get_property_value (dev, "OVER_CURRENT_COUNT");
+    ev->alarm = NULL;
+    ev->seqnum = udev_device_get_seqnum (dev);
+    ev->recv_time = POWER_NOW ();
+}
+
+/* Read the first byte of an alarm attribute, without allocating */
+static int read_alarm (const PowerUevent *ev, const char *fmt, const char *arg)
+{
+    char path[PATH_MAX], c;
+    int fd, val = EOF;
+
+    if (ev->alarm) return ev->alarm[0];
+
+#ifdef POWER_INSTRUMENT
+    gint64 start = stats_now_ns ();
+#endif
+    if (snprintf (path, sizeof (path), fmt, arg) >= (int) sizeof (path)) return EOF;
+    fd = open (FIXTURE (path), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        if (read (fd, &c, 1) == 1) val = (unsigned char) c;
+        close (fd);
+    }
+    STAT_HIST (HIST_SYSFS_READ, stats_now_ns () - start);
+    return val;
+}
+
+/* Handlers return FALSE if the event is of no interest */
+
+static gboolean handle_overcurrent (PowerPlugin *pt, const PowerUevent *ev)
+{
+    int val;
+
+    if (g_strcmp0 (ev->action, "change") || !ev->oc_port || !ev->oc_count) return FALSE;
+
+    EVENT_LATENCY (HIST_EVENT_FILTER, ev->recv_time);
+    val = read_alarm (ev, "/sys/%s/disable", ev->oc_port);
+    TRACE2 (alarm_read, ev->seqnum, val);
+    EVENT_LATENCY (HIST_EVENT_DECISION, ev->recv_time);
+    if (val == 0x31)
+    {
+        if (sscanf (ev->oc_count, "%d", &val) != 1) return TRUE;
+        set_port_count (pt, ev->oc_port, val);
+        IPC_CHANGED (pt, 0);
+        if (val != pt->last_oc)
         {
-            path = g_strdup_printf ("%s/in0_lcrit_alarm", udev_device_get_syspath (dev));
-            fp = fopen (path, "rb");
-            if (fp)
-            {
-                if (fgetc (fp) == 0x31)
-                {
-                    wrap_critical (pt->panel, _("Low voltage warning\nPlease check your power supply"));
-                    pt->show_icon |= ICON_LOW_VOLTAGE;
-                    update_icon (pt);
-                }
-                fclose (fp);
-            }
-            g_free (path);
+            alarm_over_current (pt, ev->recv_time);
+            pt->last_oc = val;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean handle_lowvoltage (PowerPlugin *pt, const PowerUevent *ev)
+{
+    const char *sysname;
+    int val;
+
+    if (g_strcmp0 (ev->action, "change") || !ev->devpath) return FALSE;
+    sysname = strrchr (ev->devpath, '/');
+    if (!sysname || strncmp (sysname + 1, "hwmon", 5)) return FALSE;
+
+    EVENT_LATENCY (HIST_EVENT_FILTER, ev->recv_time);
+    val = read_alarm (ev, "/sys%s/in0_lcrit_alarm", ev->devpath);
+    TRACE2 (alarm_read, ev->seqnum, val);
+    EVENT_LATENCY (HIST_EVENT_DECISION, ev->recv_time);
+    if (val == 0x31) alarm_low_voltage (pt, ev->recv_time);
+
+    /* The firmware's undervoltage flags change along with the alarm */
+    pt->throttled = read_throttled (pt);
+    IPC_CHANGED (pt, 0);
+    return TRUE;
+}
+
+void power_uevent (PowerPlugin *pt, const PowerUevent *ev)
+{
+    gboolean handled = FALSE;
+
+    STAT_BEGIN (STAT_UEVENT);
+    TRACE3 (uevent_received, ev->seqnum, ev->subsystem, ev->action);
+    if (!g_strcmp0 (ev->subsystem, "usb")) handled = handle_overcurrent (pt, ev);
+    else if (!g_strcmp0 (ev->subsystem, "hwmon")) handled = handle_lowvoltage (pt, ev);
+    if (!handled) TRACE2 (event_filtered, ev->seqnum, ev->subsystem);
+    STAT_END (STAT_UEVENT);
+}
+
+/* Alarms - with the kernel log monitor, the same condition is reported both by
+ * it and by the uevent, so only the first report within the de-duplication
+ * window raises a notification; without it, every alarm is shown. The time of
+ * the originating event is passed in so that the delay to the notification
+ * and icon can be measured, or 0 where there is no such event */
+
+static void alarm_low_voltage (PowerPlugin *pt, gint64 since)
+{
+    gint64 now = POWER_NOW ();
+    PowerEvent *ev;
+
+#ifdef KMSG_MONITOR
+    if (pt->lv_time && now - pt->lv_time < DEDUP_WINDOW) return;
+#endif
+    pt->lv_time = now;
+
+    TRACE1 (condition_set, ICON_LOW_VOLTAGE);
+    TRACE1 (notification_sent, "low voltage");
+    STAT_COUNT (COUNT_NOTIFY);
+    wrap_critical (pt->panel, _("Low voltage warning\nPlease check your power supply"));
+    EVENT_LATENCY (HIST_EVENT_NOTIFY, since);
+    pt->show_icon |= ICON_LOW_VOLTAGE;
+    ev = add_history (pt, ICON_LOW_VOLTAGE);
+    update_icon (pt);
+    EVENT_LATENCY (HIST_EVENT_ICON, since);
+    IPC_CHANGED (pt, ICON_LOW_VOLTAGE);
+    attrib_start (ev);
+}
+
+static void alarm_over_current (PowerPlugin *pt, gint64 since)
+{
+    gint64 now = POWER_NOW ();
+    PowerEvent *ev;
+
+#ifdef KMSG_MONITOR
+    if (pt->oc_time && now - pt->oc_time < DEDUP_WINDOW) return;
+#endif
+    pt->oc_time = now;
+
+    TRACE1 (condition_set, ICON_OVER_CURRENT);
+    TRACE1 (notification_sent, "overcurrent");
+    STAT_COUNT (COUNT_NOTIFY);
+    wrap_critical (pt->panel, _("USB overcurrent\nPlease check your connected USB devices"));
+    EVENT_LATENCY (HIST_EVENT_NOTIFY, since);
+    pt->show_icon |= ICON_OVER_CURRENT;
+    ev = add_history (pt, ICON_OVER_CURRENT);
+    update_icon (pt);
+    EVENT_LATENCY (HIST_EVENT_ICON, since);
+    IPC_CHANGED (pt, ICON_OVER_CURRENT);
+    attrib_start (ev);
+}
+
+#ifdef KMSG_MONITOR
+
+/* Kernel log - firmware undervoltage and USB hub overcurrent messages often
+ * arrive before the hwmon alarm and the port uevent. Each read returns one
+ * record of the form "prio,seq,usec,flags;device: text\n", where usec is the
+ * monotonic time at which the kernel logged it */
+
+static gboolean cb_kmsg_fd (gint fd, GIOCondition cond, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+    char buf[KMSG_RECORD_MAX];
+    char *msg, *ptr;
+    gint64 since;
+    ssize_t len;
+
+    if (cond & (G_IO_ERR | G_IO_HUP))
+    {
+        pt->kmsg_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    while (1)
+    {
+        len = read (fd, buf, sizeof (buf) - 1);
+        if (len < 0)
+        {
+            /* EPIPE means records were overwritten before we read them - carry on from the next one */
+            if (errno == EPIPE || errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+
+            /* Anything else will fail again on the next poll, so stop watching */
+            pt->kmsg_id = 0;
+            return G_SOURCE_REMOVE;
+        }
+        if (len == 0) break;
+        buf[len] = 0;
+
+        /* Skip the record header and the device name prefix */
+        msg = memchr (buf, ';', len);
+        if (!msg) continue;
+        msg = strstr (msg + 1, ": ");
+        if (!msg) continue;
+        msg += 2;
+
+        ptr = strchr (buf, ',');
+        ptr = ptr ? strchr (ptr + 1, ',') : NULL;
+        since = ptr ? g_ascii_strtoll (ptr + 1, NULL, 10) : 0;
+
+        if (!strncmp (msg, "Undervoltage detected!", 22))
+        {
+            EVENT_LATENCY (HIST_EVENT_FILTER, since);
+            alarm_low_voltage (pt, since);
+        }
+        else if (!strncmp (msg, "over-current condition", 22))
+        {
+            EVENT_LATENCY (HIST_EVENT_FILTER, since);
+            alarm_over_current (pt, since);
         }
-        udev_device_unref (dev);
     }
 
     return G_SOURCE_CONTINUE;
 }
 
+#endif
+
+/* Suspend and resume - uevents raised while suspended can be lost, so the
+ * overcurrent counts and firmware throttle flags are read before sleeping
+ * and compared again in one pass on resume, and the low voltage condition is
+ * set or cleared to match the alarm as it now stands */
+
+static int read_sysfs_int (const char *dir, const char *attr, int base)
+{
+    char path[PATH_MAX], buf[32];
+    int fd, val;
+    ssize_t len;
+
+    if (snprintf (path, sizeof (path), "%s/%s", dir, attr) >= (int) sizeof (path)) return -1;
+    fd = open (FIXTURE (path), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    len = read (fd, buf, sizeof (buf) - 1);
+    close (fd);
+    if (len <= 0) return -1;
+    buf[len] = 0;
+    val = strtol (buf, NULL, base);
+    return val;
+}
+
+/* Keeps the last count seen for each port, so the state snapshot can list
+ * them without going back to sysfs, and the total over them */
+static void set_port_count (PowerPlugin *pt, const char *port, int count)
+{
+    const char *name = strrchr (port, '/');
+    int i;
+
+    name = name ? name + 1 : port;
+    for (i = 0; i < pt->num_oc_ports; i++)
+        if (!strcmp (pt->oc_ports[i].name, name)) break;
+    if (i == pt->num_oc_ports)
+    {
+        if (i == OC_PORTS) return;
+        g_strlcpy (pt->oc_ports[i].name, name, sizeof (pt->oc_ports[i].name));
+        pt->num_oc_ports++;
+    }
+    pt->oc_ports[i].count = count;
+
+    pt->oc_total = 0;
+    for (i = 0; i < pt->num_oc_ports; i++) pt->oc_total += pt->oc_ports[i].count;
+}
+
+/* Re-reads the count of every port, keeping only those that have had an
+ * overcurrent so that the table is not filled by idle ports */
+static int read_oc_total (PowerPlugin *pt)
+{
+    struct udev_enumerate *en;
+    struct udev_list_entry *entry;
+    const char *syspath;
+    struct dirent *de;
+    char port[PATH_MAX];
+    DIR *dir;
+    int count;
+
+    /* Hub ports are children of the hub interface, named usbN-portM */
+    en = udev_enumerate_new (pt->udev);
+    if (!en) return pt->oc_total;
+    pt->num_oc_ports = 0;
+    pt->oc_total = 0;
+    udev_enumerate_add_match_subsystem (en, "usb");
+    udev_enumerate_add_match_property (en, "DEVTYPE", "usb_interface");
+    udev_enumerate_scan_devices (en);
+    udev_list_entry_foreach (entry, udev_enumerate_get_list_entry (en))
+    {
+        syspath = udev_list_entry_get_name (entry);
+        dir = opendir (FIXTURE (syspath));
+        if (!dir) continue;
+        while ((de = readdir (dir)))
+        {
+            if (!strstr (de->d_name, "-port")) continue;
+            snprintf (port, sizeof (port), "%s/%s", syspath, de->d_name);
+            count = read_sysfs_int (port, "over_current_count", 10);
+            if (count > 0) set_port_count (pt, de->d_name, count);
+        }
+        closedir (dir);
+    }
+    udev_enumerate_unref (en);
+    return pt->oc_total;
+}
+
+/* The firmware device is looked up once - after that, a read is a single sysfs
+ * read that does not allocate, so it can be done on every low voltage uevent */
+static int read_throttled (PowerPlugin *pt)
+{
+    struct udev_enumerate *en;
+    struct udev_list_entry *entry;
+
+    if (!pt->throttled_dir)
+    {
+        en = udev_enumerate_new (pt->udev);
+        if (!en) return -1;
+        udev_enumerate_add_match_subsystem (en, "platform");
+        udev_enumerate_add_match_sysattr (en, THROTTLED_ATTR, NULL);
+        udev_enumerate_scan_devices (en);
+        entry = udev_enumerate_get_list_entry (en);
+        pt->throttled_dir = g_strdup (entry ? udev_list_entry_get_name (entry) : "");
+        udev_enumerate_unref (en);
+    }
+
+    if (!*pt->throttled_dir) return -1;
+    return read_sysfs_int (pt->throttled_dir, THROTTLED_ATTR, 16);
+}
+
+static void resync_state (PowerPlugin *pt)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+    int val, total, alarm = -1;
+
+    /* Hold icon updates so that the whole pass results in one redraw */
+    pt->resyncing = TRUE;
+
+    /* Only the firmware's hwmon device has the alarm - -1 if none was read */
+    dir = opendir (FIXTURE (HWMON_CLASS));
+    if (dir)
+    {
+        while ((de = readdir (dir)))
+        {
+            if (strncmp (de->d_name, "hwmon", 5)) continue;
+            snprintf (path, sizeof (path), HWMON_CLASS "/%s", de->d_name);
+            alarm = MAX (alarm, read_sysfs_int (path, "in0_lcrit_alarm", 10));
+        }
+        closedir (dir);
+    }
+    if (alarm == 1) alarm_low_voltage (pt, 0);
+    else if (alarm == 0 && (pt->show_icon & ICON_LOW_VOLTAGE))
+    {
+        pt->show_icon &= ~ICON_LOW_VOLTAGE;
+        update_icon (pt);
+    }
+
+    val = read_throttled (pt);
+    if (val >= 0 && pt->throttled >= 0 && (val & ~pt->throttled & THROTTLE_UV_OCCURRED)) alarm_low_voltage (pt, 0);
+    pt->throttled = val;
+
+    total = pt->oc_total;
+    if (read_oc_total (pt) > total) alarm_over_current (pt, 0);
+    IPC_CHANGED (pt, 0);
+
+    pt->resyncing = FALSE;
+    if (pt->icon_pending) update_icon (pt);
+}
+
+static void prepare_sleep (PowerPlugin *pt, gboolean sleeping)
+{
+    if (sleeping)
+    {
+        pt->throttled = read_throttled (pt);
+        read_oc_total (pt);
+        IPC_CHANGED (pt, 0);
+    }
+    else resync_state (pt);
+}
+
+static void cb_prepare_sleep (GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *params, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+    gboolean sleeping;
+
+    /* The resync enumerates devices and reads sysfs, so is timed as a dispatch */
+    STAT_DISPATCH_BEGIN ();
+    if (g_variant_is_of_type (params, G_VARIANT_TYPE ("(b)")))
+    {
+        g_variant_get (params, "(b)", &sleeping);
+        prepare_sleep (pt, sleeping);
+    }
+    STAT_DISPATCH_END ();
+}
+
+static void cb_system_bus (GObject *, GAsyncResult *res, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+    GDBusConnection *conn;
+
+    conn = g_bus_get_finish (res, NULL);
+    if (!conn) return;
+
+    pt->system_bus = conn;
+    pt->sleep_id = g_dbus_connection_signal_subscribe (pt->system_bus, "org.freedesktop.login1",
+        "org.freedesktop.login1.Manager", "PrepareForSleep", "/org/freedesktop/login1", NULL,
+        G_DBUS_SIGNAL_FLAGS_NONE, cb_prepare_sleep, pt, NULL);
+}
+
+/* Sampling profile - while the screen is blanked, nobody can see the icon, so
+ * GTK work is deferred and energy readings are taken less often; kernel alarm
+ * edges and notifications stay live */
+
+static void cb_screensaver (GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *params, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+    gboolean active;
+
+    STAT_DISPATCH_BEGIN ();
+    if (g_variant_is_of_type (params, G_VARIANT_TYPE ("(b)")))
+    {
+        g_variant_get (params, "(b)", &active);
+        set_background (pt, active);
+    }
+    STAT_DISPATCH_END ();
+}
+
+static void cb_screensaver_state (GObject *source, GAsyncResult *res, gpointer data)
+{
+    GVariant *var;
+    gboolean active;
+
+    var = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, NULL);
+    if (var)
+    {
+        g_variant_get (var, "(b)", &active);
+        set_background ((PowerPlugin *) data, active);
+        g_variant_unref (var);
+    }
+}
+
+/* The bus connection is made asynchronously so as not to hold up the panel
+ * starting; on cancellation the plugin may be gone, so it is not touched */
+static void cb_session_bus (GObject *, GAsyncResult *res, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+    GDBusConnection *conn;
+
+    conn = g_bus_get_finish (res, NULL);
+    if (!conn) return;
+
+    pt->session_bus = conn;
+    pt->screensaver_id = g_dbus_connection_signal_subscribe (pt->session_bus, NULL, "org.freedesktop.ScreenSaver",
+        "ActiveChanged", NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE, cb_screensaver, pt, NULL);
+    g_dbus_connection_call (pt->session_bus, "org.freedesktop.ScreenSaver", "/org/freedesktop/ScreenSaver",
+        "org.freedesktop.ScreenSaver", "GetActive", NULL, G_VARIANT_TYPE ("(b)"), G_DBUS_CALL_FLAGS_NO_AUTO_START,
+        -1, pt->cancellable, cb_screensaver_state, pt);
+#ifdef IPC_PUBLISH
+    ipc_bus_ready (pt->session_bus);
+#endif
+}
+
+static void set_background (PowerPlugin *pt, gboolean background)
+{
+    pt->background = background;
+    attrib_background (background);
+#ifdef ENERGY_MONITOR
+    energy_background (background);
+#endif
+    if (!pt->background && pt->icon_pending) update_icon (pt);
+}
+
 /* Update the icon to show current status */
 
+/* Only work that changes something is done, so that repeated updates in the
+ * same state do not allocate */
+
 static void update_icon (PowerPlugin *pt)
 {
-    char *tooltip;
+    char tooltip[256];
+    size_t len;
+
+    if (pt->background || pt->resyncing)
+    {
+        pt->icon_pending = TRUE;
+        return;
+    }
+    pt->icon_pending = FALSE;
+    STAT_BEGIN (STAT_UPDATE_ICON);
+    MARK_BEGIN (update_icon);
+    TRACE1 (icon_updated, pt->show_icon);
 
-    wrap_set_taskbar_icon (pt, pt->tray_icon, "under-volt");
+    if (!pt->icon_loaded)
+    {
+        wrap_set_taskbar_icon (pt, pt->tray_icon, "under-volt");
+        pt->icon_loaded = TRUE;
+    }
     gtk_widget_set_sensitive (pt->plugin, pt->show_icon);
 
     if (!pt->show_icon) gtk_widget_hide (pt->plugin);
     else
     {
         gtk_widget_show_all (pt->plugin);
-        tooltip = g_strconcat (pt->show_icon & ICON_LOW_VOLTAGE ? _("PSU low voltage detected\n") : "",
-            pt->show_icon & ICON_OVER_CURRENT ? _("USB over current detected\n") : "",
-            pt->show_icon & ICON_BROWNOUT ? _("Low power reset has occurred\n") : "", NULL);
-        tooltip[strlen (tooltip) - 1] = 0;
-        gtk_widget_set_tooltip_text (pt->tray_icon, tooltip);
-        g_free (tooltip);
+        if (pt->tooltip_flags != pt->show_icon)
+        {
+            tooltip[0] = 0;
+            if (pt->show_icon & ICON_LOW_VOLTAGE) g_strlcat (tooltip, _("PSU low voltage detected\n"), sizeof (tooltip));
+            if (pt->show_icon & ICON_OVER_CURRENT) g_strlcat (tooltip, _("USB over current detected\n"), sizeof (tooltip));
+            if (pt->show_icon & ICON_BROWNOUT) g_strlcat (tooltip, _("Low power reset has occurred\n"), sizeof (tooltip));
+            len = strlen (tooltip);
+            if (len) tooltip[len - 1] = 0;
+            gtk_widget_set_tooltip_text (pt->tray_icon, tooltip);
+            pt->tooltip_flags = pt->show_icon;
+        }
     }
+
+    MARK_END (update_icon, NULL);
+    STAT_END (STAT_UPDATE_ICON);
+}
+
+/* Memory use - the plugin's own buffers are all fixed size, so report them
+ * against the budget along with the resident size of the whole panel */
+
+/* Buffers owned by the plugin - the warnings file is only held while it is
+ * read, but is counted in full as that can happen at any time */
+gsize power_memory (void)
+{
+    gsize total = sizeof (PowerPlugin) + WARN_FILE_MAX + 1 + attrib_memory ();
+
+#ifdef IPC_PUBLISH
+    total += ipc_memory ();
+#endif
+#ifdef POWER_INSTRUMENT
+    total += stats_memory ();
+#endif
+#ifdef ENERGY_MONITOR
+    total += energy_memory ();
+#endif
+    return total;
+}
+
+/* Resident set size of the whole panel process in kB, or -1 if unknown */
+long power_resident_kb (void)
+{
+    long pages, resident = -1;
+    FILE *fp;
+
+    fp = fopen ("/proc/self/statm", "rb");
+    if (!fp) return -1;
+    if (fscanf (fp, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose (fp);
+    return resident < 0 ? -1 : resident * sysconf (_SC_PAGESIZE) / 1024;
+}
+
+static void report_memory (void)
+{
+    gsize used = power_memory ();
+    long resident = power_resident_kb ();
+
+    if (used > MEM_BUDGET) g_warning ("power: buffers take %zu bytes, over the %d kB budget", used, MEM_BUDGET_KB);
+    if (resident >= 0) g_debug ("power: buffers %zu bytes of %d kB budget, panel RSS %ld kB", used, MEM_BUDGET_KB, resident);
+}
+
+/* Event history */
+
+static PowerEvent *add_history (PowerPlugin *pt, int type)
+{
+    PowerEvent *ev = &pt->history[pt->hist_next];
+
+    memset (ev, 0, sizeof (PowerEvent));
+    ev->time = g_get_real_time ();
+    ev->type = type;
+    pt->hist_next = (pt->hist_next + 1) % HISTORY_LEN;
+    if (pt->hist_count < HISTORY_LEN) pt->hist_count++;
+    return ev;
+}
+
+static const char *event_text (int type)
+{
+    switch (type)
+    {
+        case ICON_LOW_VOLTAGE :     return _("Low voltage detected");
+        case ICON_OVER_CURRENT :    return _("USB overcurrent detected");
+        case ICON_BROWNOUT :        return _("Reset due to low power event");
+        default :                   return "";
+    }
+}
+
+/* Power information dialog - built locally rather than opening a web page,
+ * so that it is quick to show and works without a network connection */
+
+/* One line listing the processes that were busiest when an event happened */
+static void append_procs (GString *str, const char *label, const PowerProc *procs, gboolean io)
+{
+    int i;
+
+    if (!procs[0].pid) return;
+    g_string_append_printf (str, "    %s:", label);
+    for (i = 0; i < ATTRIB_TOP && procs[i].pid; i++)
+    {
+        if (io) g_string_append_printf (str, "%s %s (%d) %u kB/s", i ? "," : "", procs[i].comm, procs[i].pid, procs[i].value);
+        else g_string_append_printf (str, "%s %s (%d) %u.%u%%", i ? "," : "", procs[i].comm, procs[i].pid,
+            procs[i].value / 10, procs[i].value % 10);
+    }
+    g_string_append_c (str, '\n');
+}
+
+static void info_add_section (GtkWidget *box, const char *title, const char *text)
+{
+    GtkWidget *label;
+    char *markup;
+
+    label = gtk_label_new (NULL);
+    markup = g_markup_printf_escaped ("<b>%s</b>", title);
+    gtk_label_set_markup (GTK_LABEL (label), markup);
+    g_free (markup);
+    gtk_widget_set_halign (label, GTK_ALIGN_START);
+    gtk_box_pack_start (GTK_BOX (box), label, FALSE, FALSE, 0);
+
+    label = gtk_label_new (text);
+    gtk_label_set_line_wrap (GTK_LABEL (label), TRUE);
+    gtk_label_set_max_width_chars (GTK_LABEL (label), 60);
+    gtk_label_set_xalign (GTK_LABEL (label), 0.0);
+    gtk_widget_set_halign (label, GTK_ALIGN_START);
+    gtk_box_pack_start (GTK_BOX (box), label, FALSE, FALSE, 0);
+}
+
+static void show_info (GtkWidget *, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+    GtkWidget *box;
+    GString *str;
+    GDateTime *dt;
+    char *tstr;
+    int i, index;
+
+    if (pt->info_dlg)
+    {
+        gtk_window_present (GTK_WINDOW (pt->info_dlg));
+        return;
+    }
+
+    MARK_BEGIN (show_info);
+    pt->info_dlg = gtk_dialog_new_with_buttons (_("Power Information"), NULL, 0, _("_Close"), GTK_RESPONSE_CLOSE, NULL);
+    gtk_window_set_position (GTK_WINDOW (pt->info_dlg), GTK_WIN_POS_CENTER);
+    g_signal_connect (pt->info_dlg, "response", G_CALLBACK (gtk_widget_destroy), NULL);
+    g_signal_connect (pt->info_dlg, "destroy", G_CALLBACK (gtk_widget_destroyed), &pt->info_dlg);
+
+    box = gtk_dialog_get_content_area (GTK_DIALOG (pt->info_dlg));
+    gtk_box_set_spacing (GTK_BOX (box), 6);
+    gtk_container_set_border_width (GTK_CONTAINER (box), 12);
+
+    str = g_string_new (NULL);
+
+    /* Power supply capability */
+    if (pt->max_current > 0)
+        g_string_printf (str, _("The power supply reports that it can provide %d mA."), pt->max_current);
+    else g_string_assign (str, _("The power supply has not reported its capability."));
+    info_add_section (box, _("Power supply"), str->str);
+
+    /* Current state */
+    g_string_truncate (str, 0);
+    if (pt->show_icon & ICON_LOW_VOLTAGE) g_string_append_printf (str, "%s\n", event_text (ICON_LOW_VOLTAGE));
+    if (pt->show_icon & ICON_OVER_CURRENT) g_string_append_printf (str, "%s\n", event_text (ICON_OVER_CURRENT));
+    if (pt->show_icon & ICON_BROWNOUT) g_string_append_printf (str, "%s\n", event_text (ICON_BROWNOUT));
+    if (str->len) g_string_truncate (str, str->len - 1);
+    else g_string_assign (str, _("No power problems have been detected."));
+    info_add_section (box, _("Status"), str->str);
+
+    /* Event history, most recent first */
+    g_string_truncate (str, 0);
+    for (i = 1; i <= pt->hist_count; i++)
+    {
+        index = (pt->hist_next + HISTORY_LEN - i) % HISTORY_LEN;
+        dt = g_date_time_new_from_unix_local (pt->history[index].time / G_USEC_PER_SEC);
+        tstr = g_date_time_format (dt, "%x %X");
+        g_string_append_printf (str, "%s  %s\n", tstr, event_text (pt->history[index].type));
+        append_procs (str, _("CPU"), pt->history[index].cpu, FALSE);
+        append_procs (str, _("Disk I/O"), pt->history[index].io, TRUE);
+        g_free (tstr);
+        g_date_time_unref (dt);
+    }
+    if (str->len) g_string_truncate (str, str->len - 1);
+    else g_string_assign (str, _("None"));
+    info_add_section (box, _("Recent events"), str->str);
+
+#ifdef ENERGY_MONITOR
+    /* Energy use, once there have been readings */
+    tstr = energy_summary ();
+    if (tstr) info_add_section (box, _("Energy"), tstr);
+    g_free (tstr);
+#endif
+
+    g_string_free (str, TRUE);
+
+    /* Advice */
+    info_add_section (box, _("Advice"),
+        _("Raspberry Pi 5 needs a 5V 5A power supply to provide full current to USB peripherals; "
+        "with a 3A supply, USB current is limited to 600mA in total.\n\n"
+        "If low voltage warnings appear, use the official Raspberry Pi power supply, or a good quality "
+        "USB-C PD supply with a short, thick cable. Avoid powering the board through a USB hub or from a "
+        "computer's USB port.\n\n"
+        "If USB overcurrent warnings appear, disconnect high power devices such as hard drives, or connect "
+        "them through a powered USB hub."));
+
+    gtk_widget_show_all (pt->info_dlg);
+    MARK_END (show_info, NULL);
+}
+
+#ifdef POWER_INSTRUMENT
+
+/* Latency statistics dialog, from the debug menu entry */
+
+static void show_stats (GtkWidget *, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+    GtkWidget *box, *label;
+    char *summary, *markup;
+
+    if (pt->stats_dlg) gtk_widget_destroy (pt->stats_dlg);
+
+    pt->stats_dlg = gtk_dialog_new_with_buttons (_("Power Statistics"), NULL, 0, _("_Close"), GTK_RESPONSE_CLOSE, NULL);
+    g_signal_connect (pt->stats_dlg, "response", G_CALLBACK (gtk_widget_destroy), NULL);
+    g_signal_connect (pt->stats_dlg, "destroy", G_CALLBACK (gtk_widget_destroyed), &pt->stats_dlg);
+
+    box = gtk_dialog_get_content_area (GTK_DIALOG (pt->stats_dlg));
+    gtk_container_set_border_width (GTK_CONTAINER (box), 12);
+
+    summary = stats_summary ();
+    markup = g_markup_printf_escaped ("<tt>%s</tt>", summary);
+    label = gtk_label_new (NULL);
+    gtk_label_set_markup (GTK_LABEL (label), markup);
+    gtk_label_set_selectable (GTK_LABEL (label), TRUE);
+    gtk_box_pack_start (GTK_BOX (box), label, FALSE, FALSE, 0);
+    g_free (markup);
+    g_free (summary);
+
+    gtk_widget_show_all (pt->stats_dlg);
+}
+
+#endif
+
+#ifdef POWER_INSTRUMENT
+
+/* Load time - from the module constructor to the first idle after the panel
+ * has drawn the frame containing the plugin. Redraws run at a higher
+ * priority than default idle sources, so this idle follows the first frame */
+
+static void __attribute__ ((constructor)) power_loaded (void)
+{
+    load_time = g_get_monotonic_time ();
 }
 
-static void show_info (GtkWidget *, gpointer)
+static gboolean cb_first_frame (gpointer)
 {
-    system ("x-www-browser https://rptl.io/rpi5-power-supply-info &");
+    g_message ("power: %" G_GINT64_FORMAT " us from module load to first frame", g_get_monotonic_time () - load_time);
+    return G_SOURCE_REMOVE;
+}
+
+/* Paint times - the frame clock belongs to the panel window, so this times
+ * the paint of the whole panel each frame, as a probe of per-frame work; the
+ * harness replay and stress commands show what the plugin's event handling
+ * does to it */
+
+static void cb_before_paint (GdkFrameClock *, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+
+    pt->paint_start = stats_now_ns ();
+}
+
+static void cb_after_paint (GdkFrameClock *, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+
+    if (pt->paint_start) stats_paint (stats_now_ns () - pt->paint_start);
+    pt->paint_start = 0;
 }
 
+static void watch_frames (GtkWidget *widget, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+
+    g_signal_handlers_disconnect_by_func (widget, watch_frames, data);
+    if (pt->frame_clock) return;
+    pt->frame_clock = gtk_widget_get_frame_clock (widget);
+    if (!pt->frame_clock) return;
+
+    g_object_ref (pt->frame_clock);
+    g_signal_connect (pt->frame_clock, "before-paint", G_CALLBACK (cb_before_paint), pt);
+    g_signal_connect (pt->frame_clock, "after-paint", G_CALLBACK (cb_after_paint), pt);
+}
+
+#endif
+
 /*----------------------------------------------------------------------------*/
 /* wf-panel plugin functions                                                  */
 /*----------------------------------------------------------------------------*/
@@ -313,21 +1274,109 @@ static void show_info (GtkWidget *, gpointer)
 static void power_button_clicked (GtkWidget *, PowerPlugin *pt)
 {
     CHECK_LONGPRESS
+    MARK_BEGIN (menu_popup);
     gtk_widget_show_all (pt->menu);
     wrap_show_menu (pt->plugin, pt->menu);
+    MARK_END (menu_popup, NULL);
 }
 
 /* Handler for system config changed message from panel */
 void power_update_display (PowerPlugin *pt)
 {
+    /* Icon size or theme may have changed */
+    pt->icon_loaded = FALSE;
     update_icon (pt);
 }
 
+#ifdef POWER_HARNESS
+
+/* The boot time checks that read the device tree, for the scenario runner */
+void power_boot_checks (PowerPlugin *pt)
+{
+    check_psu (pt);
+    check_brownout (pt);
+}
+
+/* PrepareForSleep as logind would send it, for the scenario runner */
+void power_prepare_sleep (PowerPlugin *pt, gboolean sleeping)
+{
+    prepare_sleep (pt, sleeping);
+}
+
+/* One timed call of a check or of the icon update, given by its StatId, for
+ * the benchmark - the memory check is given a 1GB board so that it goes on to
+ * query the displays */
+void power_bench_call (PowerPlugin *pt, int id)
+{
+    switch (id)
+    {
+        case STAT_CHECK_PSU :           STAT_CALL (STAT_CHECK_PSU, check_psu (pt));
+                                        break;
+        case STAT_CHECK_BROWNOUT :      STAT_CALL (STAT_CHECK_BROWNOUT, check_brownout (pt));
+                                        break;
+        case STAT_CHECK_USER_WARNINGS : STAT_CALL (STAT_CHECK_USER_WARNINGS, check_user_warnings (pt));
+                                        break;
+        case STAT_CHECK_MEMRES :        STAT_CALL (STAT_CHECK_MEMRES, check_memres (pt, 1024));
+                                        break;
+        case STAT_UPDATE_ICON :         update_icon (pt);
+                                        break;
+        default :                       break;
+    }
+}
+
+/* Injected uevents, read from the harness's socket as the monitors would read theirs */
+static gboolean cb_injected_fd (gint fd, GIOCondition cond, gpointer data)
+{
+    PowerPlugin *pt = (PowerPlugin *) data;
+    char buf[UEVENT_PAYLOAD_MAX];
+    PowerUevent ev;
+    ssize_t len = 0;
+
+    if (cond & G_IO_IN) len = recv (fd, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) return G_SOURCE_CONTINUE;
+    if (len <= 0)
+    {
+        pt->overcurrent_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    buf[len] = 0;
+    replay_parse (buf, len, &ev);
+    power_uevent (pt, &ev);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Stop watching the netlink monitors and the kernel log and watch the given
+ * socket instead, so that a test sees only the events it injects and none
+ * from the machine running it */
+void power_monitor_fd (PowerPlugin *pt, int fd)
+{
+    if (pt->overcurrent_id > 0) g_source_remove (pt->overcurrent_id);
+    if (pt->lowvoltage_id > 0) g_source_remove (pt->lowvoltage_id);
+    pt->lowvoltage_id = 0;
+    if (pt->kmsg_id > 0) g_source_remove (pt->kmsg_id);
+    pt->kmsg_id = 0;
+    pt->overcurrent_id = POWER_FD_ADD (fd, G_IO_IN | G_IO_HUP | G_IO_ERR, cb_injected_fd, pt);
+}
+
+#endif
+
 void power_init (PowerPlugin *pt)
 {
-    setlocale (LC_ALL, "");
-    bindtextdomain (GETTEXT_PACKAGE, PACKAGE_LOCALE_DIR);
-    bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+    MARK_BEGIN (power_init);
+    TRACE1 (startup_phase, "init");
+#ifdef POWER_INSTRUMENT
+    gint64 init_start = g_get_monotonic_time ();
+#endif
+
+    /* Text domain binding is process-wide, so only needed for the first instance */
+    if (!locale_bound)
+    {
+        setlocale (LC_ALL, "");
+        bindtextdomain (GETTEXT_PACKAGE, PACKAGE_LOCALE_DIR);
+        bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+        locale_bound = TRUE;
+    }
 
     /* Allocate icon as a child of top level */
     pt->tray_icon = gtk_image_new ();
@@ -347,11 +1396,40 @@ void power_init (PowerPlugin *pt)
     pt->overcurrent_id = 0;
     pt->lowvoltage_id = 0;
     pt->startup_id = 0;
+    pt->max_current = -1;
+    pt->power_reset = -1;
+    pt->hist_next = 0;
+    pt->hist_count = 0;
+    pt->info_dlg = NULL;
+    pt->kmsg_fd = -1;
+    pt->kmsg_id = 0;
+    pt->lv_time = 0;
+    pt->oc_time = 0;
+    pt->background = FALSE;
+    pt->icon_pending = FALSE;
+    pt->icon_loaded = FALSE;
+    pt->tooltip_flags = 0;
+    pt->resyncing = FALSE;
+    pt->system_bus = NULL;
+    pt->sleep_id = 0;
+    pt->screensaver_id = 0;
+
+    /* Follow screen blanking to switch between foreground and background profiles */
+    pt->session_bus = NULL;
+    pt->cancellable = g_cancellable_new ();
+    g_bus_get (G_BUS_TYPE_SESSION, pt->cancellable, cb_session_bus, pt);
 
     pt->menu = gtk_menu_new ();
     GtkWidget *item = gtk_menu_item_new_with_label (_("Power Information..."));
-    g_signal_connect (G_OBJECT (item), "activate", G_CALLBACK (show_info), NULL);
+    g_signal_connect (G_OBJECT (item), "activate", G_CALLBACK (show_info), pt);
+    gtk_menu_shell_append (GTK_MENU_SHELL (pt->menu), item);
+
+#ifdef POWER_INSTRUMENT
+    pt->stats_dlg = NULL;
+    item = gtk_menu_item_new_with_label (_("Statistics..."));
+    g_signal_connect (G_OBJECT (item), "activate", G_CALLBACK (show_stats), pt);
     gtk_menu_shell_append (GTK_MENU_SHELL (pt->menu), item);
+#endif
 
     /* Start timed events to monitor low voltage warnings */
     if (is_pi ())
@@ -365,7 +1443,7 @@ void power_init (PowerPlugin *pt)
         {
             udev_monitor_filter_add_match_subsystem_devtype (pt->udev_mon_oc, "usb", NULL);
             udev_monitor_enable_receiving (pt->udev_mon_oc);
-            pt->overcurrent_id = g_unix_fd_add (udev_monitor_get_fd (pt->udev_mon_oc), G_IO_IN, cb_overcurrent_fd, pt);
+            pt->overcurrent_id = POWER_FD_ADD (udev_monitor_get_fd (pt->udev_mon_oc), G_IO_IN, cb_overcurrent_fd, pt);
         }
 
         pt->udev_mon_lv = udev_monitor_new_from_netlink (pt->udev, "kernel");
@@ -373,23 +1451,98 @@ void power_init (PowerPlugin *pt)
         {
             udev_monitor_filter_add_match_subsystem_devtype (pt->udev_mon_lv, "hwmon", NULL);
             udev_monitor_enable_receiving (pt->udev_mon_lv);
-            pt->lowvoltage_id = g_unix_fd_add (udev_monitor_get_fd (pt->udev_mon_lv), G_IO_IN, cb_lowvoltage_fd, pt);
+            pt->lowvoltage_id = POWER_FD_ADD (udev_monitor_get_fd (pt->udev_mon_lv), G_IO_IN, cb_lowvoltage_fd, pt);
+        }
+
+#ifdef KMSG_MONITOR
+        /* Only new records are of interest, so start from the end of the log */
+        pt->kmsg_fd = open (KMSG_PATH, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (pt->kmsg_fd >= 0)
+        {
+            lseek (pt->kmsg_fd, 0, SEEK_END);
+            pt->kmsg_id = POWER_FD_ADD (pt->kmsg_fd, G_IO_IN | G_IO_ERR | G_IO_HUP, cb_kmsg_fd, pt);
         }
+#endif
 
-        pt->startup_id = g_idle_add (startup_checks, pt);
+        /* Resynchronise state on resume from suspend */
+        pt->throttled = -1;
+        pt->oc_total = 0;
+        pt->num_oc_ports = 0;
+        g_bus_get (G_BUS_TYPE_SYSTEM, pt->cancellable, cb_system_bus, pt);
+
+        pt->startup_id = POWER_IDLE_ADD (startup_checks, pt);
+
+#ifdef ENERGY_MONITOR
+        energy_start ();
+#endif
+#ifdef IPC_PUBLISH
+        ipc_start (pt);
+#endif
     }
+
+    TRACE1 (startup_phase, "init done");
+#ifdef POWER_INSTRUMENT
+    g_message ("power: init %" G_GINT64_FORMAT " us, %" G_GINT64_FORMAT " us after module load",
+        g_get_monotonic_time () - init_start, init_start - load_time);
+    POWER_IDLE_ADD (cb_first_frame, NULL);
+
+    pt->frame_clock = NULL;
+    pt->paint_start = 0;
+    if (gtk_widget_get_realized (pt->plugin)) watch_frames (pt->plugin, pt);
+    else g_signal_connect (pt->plugin, "realize", G_CALLBACK (watch_frames), pt);
+#endif
+    MARK_END (power_init, NULL);
 }
 
 void power_destructor (gpointer user_data)
 {
     PowerPlugin *pt = (PowerPlugin *) user_data;
 
+#ifdef POWER_INSTRUMENT
+    stats_report ();
+    if (pt->frame_clock)
+    {
+        g_signal_handlers_disconnect_by_data (pt->frame_clock, pt);
+        g_object_unref (pt->frame_clock);
+    }
+    g_signal_handlers_disconnect_by_func (pt->plugin, watch_frames, pt);
+#endif
+
+#ifdef ENERGY_MONITOR
+    energy_stop ();
+#endif
+    attrib_stop ();
+#ifdef IPC_PUBLISH
+    ipc_stop (pt);
+#endif
+
     if (pt->overcurrent_id > 0) g_source_remove (pt->overcurrent_id);
     pt->overcurrent_id = 0;
     if (pt->lowvoltage_id > 0) g_source_remove (pt->lowvoltage_id);
     pt->lowvoltage_id = 0;
     if (pt->startup_id > 0) g_source_remove (pt->startup_id);
     pt->startup_id = 0;
+    if (pt->kmsg_id > 0) g_source_remove (pt->kmsg_id);
+    pt->kmsg_id = 0;
+    if (pt->kmsg_fd >= 0) close (pt->kmsg_fd);
+    pt->kmsg_fd = -1;
+
+    if (pt->info_dlg) gtk_widget_destroy (pt->info_dlg);
+#ifdef POWER_INSTRUMENT
+    if (pt->stats_dlg) gtk_widget_destroy (pt->stats_dlg);
+#endif
+
+    g_cancellable_cancel (pt->cancellable);
+    g_object_unref (pt->cancellable);
+    pt->cancellable = NULL;
+    if (pt->screensaver_id > 0) g_dbus_connection_signal_unsubscribe (pt->session_bus, pt->screensaver_id);
+    pt->screensaver_id = 0;
+    if (pt->session_bus) g_object_unref (pt->session_bus);
+    pt->session_bus = NULL;
+    if (pt->sleep_id > 0) g_dbus_connection_signal_unsubscribe (pt->system_bus, pt->sleep_id);
+    pt->sleep_id = 0;
+    if (pt->system_bus) g_object_unref (pt->system_bus);
+    pt->system_bus = NULL;
 
     if (pt->udev_mon_oc) udev_monitor_unref (pt->udev_mon_oc);
     pt->udev_mon_oc = NULL;
@@ -397,6 +1550,7 @@ void power_destructor (gpointer user_data)
     pt->udev_mon_lv = NULL;
     if (pt->udev) udev_unref (pt->udev);
     pt->udev = NULL;
+    g_free (pt->throttled_dir);
     g_free (pt);
 }
 
@@ -441,11 +1595,11 @@ static void power_configuration_changed (LXPanel *, GtkWidget *plugin)
     power_update_display (pt);
 }
 
-int module_lxpanel_gtk_version = 1;
-char module_name[] = PLUGIN_NAME;
+PLUGIN_EXPORT int module_lxpanel_gtk_version = 1;
+PLUGIN_EXPORT char module_name[] = PLUGIN_NAME;
 
 /* Plugin descriptor */
-LXPanelPluginInit fm_module_init_lxpanel_gtk = {
+PLUGIN_EXPORT LXPanelPluginInit fm_module_init_lxpanel_gtk = {
     .name = PLUGIN_TITLE,
     .description = N_("Monitors system power"),
     .new_instance = power_constructor,
@@ -30,12 +30,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "power.hpp"
 
 extern "C" {
-    WayfireWidget *create () { return new WayfirePower; }
-    void destroy (WayfireWidget *w) { delete w; }
+    PLUGIN_EXPORT WayfireWidget *create () { return new WayfirePower; }
+    PLUGIN_EXPORT void destroy (WayfireWidget *w) { delete w; }
 
-    const conf_table_t *config_params (void) { return conf_table; };
-    const char *display_name (void) { return PLUGIN_TITLE; };
-    const char *package_name (void) { return GETTEXT_PACKAGE; };
+    PLUGIN_EXPORT const conf_table_t *config_params (void) { return conf_table; };
+    PLUGIN_EXPORT const char *display_name (void) { return PLUGIN_TITLE; };
+    PLUGIN_EXPORT const char *package_name (void) { return GETTEXT_PACKAGE; };
 }
 
 bool WayfirePower::set_icon (void)
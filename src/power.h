@@ -31,6 +31,54 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define PLUGIN_TITLE N_("System Monitor")
 
+/* The modules are built with hidden visibility - only the entry points the
+ * panels look up are exported */
+#define PLUGIN_EXPORT __attribute__ ((visibility ("default")))
+
+/* Buffers sized from their shares of the memory budget, in budget.h */
+#define HISTORY_LEN         (MEM_SHARE (MEM_HISTORY) / (int) sizeof (PowerEvent))
+#define WARN_FILE_MAX       MEM_SHARE (MEM_WARN_FILE)
+
+/* Processes listed against each event */
+#define ATTRIB_TOP          3
+
+/* Hub ports whose last overcurrent count is kept */
+#define OC_PORTS            8
+
+typedef struct
+{
+    int pid;                        /* 0 for an unused entry */
+    char comm[16];
+    guint32 value;                  /* CPU in tenths of a percent, or disk I/O in kB/s */
+} PowerProc;
+
+typedef struct
+{
+    gint64 time;                    /* Wall clock time of event in usec */
+    int type;                       /* Reason flag for the event */
+    PowerProc cpu[ATTRIB_TOP];      /* Busiest processes when it happened */
+    PowerProc io[ATTRIB_TOP];
+} PowerEvent;
+
+typedef struct
+{
+    char name[24];                  /* Port device name, such as usb1-port2 */
+    int count;                      /* Last over_current_count seen */
+} PowerPort;
+
+/* Kernel uevent, either received live or replayed from a recording */
+typedef struct
+{
+    const char *action;
+    const char *subsystem;
+    const char *devpath;
+    const char *oc_port;            /* OVER_CURRENT_PORT */
+    const char *oc_count;           /* OVER_CURRENT_COUNT */
+    const char *alarm;              /* Recorded alarm attribute, or NULL to read sysfs */
+    guint64 seqnum;
+    gint64 recv_time;               /* Monotonic time of receipt in usec */
+} PowerUevent;
+
 typedef struct
 {
     GtkWidget *plugin;
@@ -44,12 +92,42 @@ typedef struct
     GtkWidget *menu;
     int show_icon;
     int last_oc;
+    int max_current;                /* PSU capability in mA, or -1 if not reported */
+    int power_reset;                /* Firmware reset reason flags, or -1 if not reported */
+    PowerEvent history[HISTORY_LEN];
+    int hist_next;
+    int hist_count;
+    GtkWidget *info_dlg;
+#ifdef POWER_INSTRUMENT
+    GtkWidget *stats_dlg;
+    GdkFrameClock *frame_clock;     /* Panel window clock, for frame times */
+    gint64 paint_start;
+#endif
     struct udev *udev;
     struct udev_monitor *udev_mon_oc;
     struct udev_monitor *udev_mon_lv;
     guint overcurrent_id;
     guint lowvoltage_id;
     guint startup_id;
+    int kmsg_fd;                    /* Kernel log reader, if enabled */
+    guint kmsg_id;
+    gint64 lv_time;                 /* Time of last low voltage alarm */
+    gint64 oc_time;                 /* Time of last overcurrent alarm */
+    gboolean background;            /* Screen blanked - defer GTK work */
+    gboolean icon_pending;          /* Icon update deferred while in background */
+    gboolean icon_loaded;           /* Icon image set for current theme and size */
+    int tooltip_flags;              /* Reasons shown in current tooltip */
+    GDBusConnection *session_bus;
+    GCancellable *cancellable;      /* Outstanding async calls */
+    GDBusConnection *system_bus;
+    guint sleep_id;
+    gboolean resyncing;             /* Re-reading state after resume */
+    int throttled;                  /* Firmware throttle flags as last read */
+    char *throttled_dir;            /* Firmware device, or empty if there is none */
+    int oc_total;                   /* Sum of the port counts below */
+    PowerPort oc_ports[OC_PORTS];   /* Non-zero counts as last read or reported by uevent */
+    int num_oc_ports;
+    guint screensaver_id;
 } PowerPlugin;
 
 extern conf_table_t conf_table[1];
@@ -61,6 +139,15 @@ extern conf_table_t conf_table[1];
 extern void power_init (PowerPlugin *pt);
 extern void power_update_display (PowerPlugin *pt);
 extern void power_destructor (gpointer user_data);
+extern void power_uevent (PowerPlugin *pt, const PowerUevent *ev);
+extern gsize power_memory (void);
+extern long power_resident_kb (void);
+#ifdef POWER_HARNESS
+extern void power_boot_checks (PowerPlugin *pt);
+extern void power_prepare_sleep (PowerPlugin *pt, gboolean sleeping);
+extern void power_bench_call (PowerPlugin *pt, int id);
+extern void power_monitor_fd (PowerPlugin *pt, int fd);
+#endif
 
 /* End of file */
 /*----------------------------------------------------------------------------*/
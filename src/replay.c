@@ -0,0 +1,260 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Replay of recorded uevents into the plugin's event handlers, either at the
+ * recorded pace or as fast as the main loop allows, reporting throughput and
+ * handler latency when the recording has been consumed */
+
+#include <string.h>
+#include <stdlib.h>
+#include <glib/gi18n.h>
+
+#ifdef POWER_HARNESS
+#include "harness.h"
+#elif defined (LXPLUG)
+#include "plugin.h"
+#else
+#include "lxutils.h"
+#endif
+
+#include "budget.h"
+#include "power.h"
+#include "replay.h"
+#include "stats.h"
+#include "uevent-file.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Events handled per dispatch when replaying as fast as possible */
+#define REPLAY_BATCH 64
+
+typedef struct
+{
+    PowerPlugin *pt;
+    GMappedFile *map;
+    const char *ptr;                /* Next record */
+    const char *end;
+    gboolean fast;
+    guint source_id;
+    gint64 start;                   /* Monotonic time replay started */
+    guint64 count;
+    gint64 *latency;                /* Handler time per event in nsec */
+    guint64 max_count;
+    PowerDoneFunc done;
+} Replay;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static Replay *replay;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static gboolean next_record (UeventRecordHeader *hdr, const char **payload);
+static gboolean cb_replay (gpointer data);
+static void schedule (void);
+static int compare_latency (const void *a, const void *b);
+static void report (void);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Record headers are not aligned in the file, so copy them out */
+static gboolean next_record (UeventRecordHeader *hdr, const char **payload)
+{
+    if (replay->end - replay->ptr < (gssize) sizeof (UeventRecordHeader)) return FALSE;
+    memcpy (hdr, replay->ptr, sizeof (UeventRecordHeader));
+    if (hdr->len == 0 || replay->end - replay->ptr - sizeof (UeventRecordHeader) < hdr->len) return FALSE;
+    *payload = replay->ptr + sizeof (UeventRecordHeader);
+    if ((*payload)[hdr->len - 1]) return FALSE;
+    return TRUE;
+}
+
+/* Events point into the payload, which must stay valid while they are handled */
+void replay_parse (const char *buf, guint32 len, PowerUevent *ev)
+{
+    const char *ptr = buf, *end = buf + len;
+
+    memset (ev, 0, sizeof (PowerUevent));
+    while (ptr < end)
+    {
+        if (!strncmp (ptr, "ACTION=", 7)) ev->action = ptr + 7;
+        else if (!strncmp (ptr, "SUBSYSTEM=", 10)) ev->subsystem = ptr + 10;
+        else if (!strncmp (ptr, "DEVPATH=", 8)) ev->devpath = ptr + 8;
+        else if (!strncmp (ptr, "OVER_CURRENT_PORT=", 18)) ev->oc_port = ptr + 18;
+        else if (!strncmp (ptr, "OVER_CURRENT_COUNT=", 19)) ev->oc_count = ptr + 19;
+        else if (!strncmp (ptr, "PPLUG_ALARM=", 12)) ev->alarm = ptr + 12;
+        else if (!strncmp (ptr, "SEQNUM=", 7)) ev->seqnum = g_ascii_strtoull (ptr + 7, NULL, 10);
+        ptr += strlen (ptr) + 1;
+    }
+    ev->recv_time = g_get_monotonic_time ();
+}
+
+static gboolean cb_replay (gpointer)
+{
+    UeventRecordHeader hdr;
+    const char *payload;
+    PowerUevent ev;
+    gint64 elapsed, start;
+    int batch = 0;
+
+    replay->source_id = 0;
+    elapsed = g_get_monotonic_time () - replay->start;
+
+    while (next_record (&hdr, &payload))
+    {
+        if (replay->fast ? batch++ == REPLAY_BATCH : (gint64) hdr.time_us > elapsed) break;
+
+        replay_parse (payload, hdr.len, &ev);
+        start = stats_now_ns ();
+        power_uevent (replay->pt, &ev);
+        if (replay->count < replay->max_count) replay->latency[replay->count] = stats_now_ns () - start;
+        replay->count++;
+
+        replay->ptr = payload + hdr.len;
+    }
+
+    schedule ();
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule (void)
+{
+    UeventRecordHeader hdr;
+    const char *payload;
+    PowerDoneFunc done;
+    gboolean passed;
+    gint64 delay;
+
+    /* A recording that ends in a partial record fails */
+    if (!next_record (&hdr, &payload))
+    {
+        report ();
+        passed = replay->ptr == replay->end;
+        if (!passed) g_message ("power: replay stopped at a damaged record");
+        done = replay->done;
+        replay_stop ();
+        if (done) done (passed);
+        return;
+    }
+
+    if (replay->fast) replay->source_id = POWER_IDLE_ADD (cb_replay, NULL);
+    else
+    {
+        delay = hdr.time_us - (g_get_monotonic_time () - replay->start);
+        replay->source_id = POWER_TIMEOUT_ADD (delay > 0 ? delay / 1000 : 0, cb_replay, NULL);
+    }
+}
+
+static int compare_latency (const void *a, const void *b)
+{
+    gint64 la = *(const gint64 *) a, lb = *(const gint64 *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static void report (void)
+{
+    gint64 elapsed = g_get_monotonic_time () - replay->start;
+    guint64 n = MIN (replay->count, replay->max_count);
+
+    if (!n) return;
+    qsort (replay->latency, n, sizeof (gint64), compare_latency);
+    g_message ("power: replayed %" G_GUINT64_FORMAT " events in %.3f s, %.0f events/s, handler latency ns "
+        "p50 %" G_GINT64_FORMAT " p90 %" G_GINT64_FORMAT " p99 %" G_GINT64_FORMAT " max %" G_GINT64_FORMAT,
+        replay->count, elapsed / 1e6, elapsed ? replay->count * 1e6 / elapsed : 0.0,
+        replay->latency[n / 2], replay->latency[n * 9 / 10], replay->latency[n * 99 / 100], replay->latency[n - 1]);
+}
+
+void replay_start (PowerPlugin *pt, const char *file, gboolean fast, PowerDoneFunc done)
+{
+    UeventFileHeader fhdr;
+    UeventRecordHeader hdr;
+    const char *payload;
+    GError *err = NULL;
+
+    if (replay) return;
+    replay = g_new0 (Replay, 1);
+    replay->pt = pt;
+    replay->fast = fast;
+    replay->done = done;
+
+    replay->map = g_mapped_file_new (file, FALSE, &err);
+    if (!replay->map)
+    {
+        g_warning ("power: cannot open replay file - %s", err->message);
+        g_error_free (err);
+        replay_stop ();
+        if (done) done (FALSE);
+        return;
+    }
+
+    replay->ptr = g_mapped_file_get_contents (replay->map);
+    replay->end = replay->ptr + g_mapped_file_get_length (replay->map);
+    if (replay->end - replay->ptr < (gssize) sizeof (fhdr)) fhdr.version = 0;
+    else memcpy (&fhdr, replay->ptr, sizeof (fhdr));
+    if (fhdr.version != UEVENT_FILE_VERSION || memcmp (fhdr.magic, UEVENT_FILE_MAGIC, 4))
+    {
+        g_warning ("power: %s is not a uevent recording", file);
+        replay_stop ();
+        if (done) done (FALSE);
+        return;
+    }
+    replay->ptr += sizeof (fhdr);
+
+    /* Count the records so the latency samples can be held in one allocation */
+    payload = replay->ptr;
+    while (next_record (&hdr, &payload))
+    {
+        replay->max_count++;
+        replay->ptr = payload + hdr.len;
+    }
+    replay->latency = g_new (gint64, replay->max_count);
+    replay->ptr = g_mapped_file_get_contents (replay->map) + sizeof (fhdr);
+
+    replay->start = g_get_monotonic_time ();
+    schedule ();
+}
+
+void replay_stop (void)
+{
+    if (!replay) return;
+    if (replay->source_id) g_source_remove (replay->source_id);
+    if (replay->map) g_mapped_file_unref (replay->map);
+    g_free (replay->latency);
+    g_free (replay);
+    replay = NULL;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,64 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Replay of recorded uevents, injection of synthetic uevent storms, scripted
+ * fault scenarios and the soak test, all run by the test harness */
+
+#ifndef POWER_REPLAY_H
+#define POWER_REPLAY_H
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Called once a replay or storm has finished, with whether it passed */
+typedef void (*PowerDoneFunc) (gboolean passed);
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+#ifdef POWER_HARNESS
+extern void replay_start (PowerPlugin *pt, const char *file, gboolean fast, PowerDoneFunc done);
+extern void replay_stop (void);
+extern void replay_parse (const char *buf, guint32 len, PowerUevent *ev);
+extern void stress_start (PowerPlugin *pt, const char *scenario, PowerDoneFunc done);
+extern void stress_stop (void);
+extern gboolean scenario_run (PowerPlugin *pt, const char *names);
+extern gboolean scenario_fixture_begin (void);
+extern gboolean scenario_fixture_write (const char *path, const char *value);
+extern void scenario_fixture_end (void);
+extern void scenario_fixture_advance (gint64 usec);
+extern gint64 scenario_now (void);
+extern const char *scenario_path (const char *path);
+extern gboolean soak_run (PowerPlugin *pt, int days);
+#endif
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
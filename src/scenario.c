@@ -0,0 +1,411 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Scripted fault scenarios - each scenario writes attribute values into a
+ * fixture copy of the sysfs and device tree paths the plugin reads, and feeds
+ * uevents straight into its handlers, all against a virtual clock so that
+ * de-duplication windows come out the same on every run. The notifications
+ * raised, the icon conditions left set and the scripted delay from the fault
+ * to its first notification are checked against what is expected.
+ *
+ * The delay is counted on the virtual clock, so it says at which step of the
+ * script the notification came, not how long detection takes on a real board
+ * - the event histograms from replay and stress runs measure that */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
+#include <ftw.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#ifdef POWER_HARNESS
+#include "harness.h"
+#elif defined (LXPLUG)
+#include "plugin.h"
+#else
+#include "lxutils.h"
+#endif
+
+#include "budget.h"
+#include "power.h"
+#include "replay.h"
+#include "stats.h"
+#include "uevent-file.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Virtual time at the start of each scenario - non-zero, as zero means "never" */
+#define SCENARIO_EPOCH (1000 * G_USEC_PER_SEC)
+
+#define HWMON_PATH  "/devices/platform/soc/soc:firmware/raspberrypi-hwmon/hwmon/hwmon1"
+#define HWMON_CLASS "/class/hwmon/hwmon1"
+#define FAN_PATH    "/devices/platform/cooling_fan/hwmon/hwmon2"
+#define THERMAL     "/devices/virtual/thermal/thermal_zone0"
+#define HUB_PATH    "devices/platform/axi/1000120000.pcie/1f00200000.usb/xhci-hcd.0/usb1/1-1"
+#define PORT1       HUB_PATH "/1-1:1.0/1-1-port1"
+#define PORT2       HUB_PATH "/1-1:1.0/1-1-port2"
+#define DT_POWER    "/proc/device-tree/chosen/power/"
+
+/* Repeat alarms within the de-duplication window are only merged when the
+ * kernel log monitor is built in, so the count expected depends on it */
+#ifdef KMSG_MONITOR
+#define DEDUPED(merged,all) (merged)
+#else
+#define DEDUPED(merged,all) (all)
+#endif
+
+/* Steps are "<msec> <command> [args]", run in order. Commands are
+ *   write <path> <value>     - value is text, or "u32:<n>" for a device tree cell
+ *   uevent <KEY=value> ...   - handled as if received from the kernel
+ *   boot                     - run the device tree checks done at startup
+ *   sleep, resume            - logind's PrepareForSleep, true then false
+ *   fault                    - the fault begins, for the scripted delay */
+typedef struct
+{
+    const char *name;
+    const char *steps[16];
+    guint64 notifications;          /* Expected notifications */
+    int conditions;                 /* Expected icon conditions at the end */
+    int delay_ms;                   /* Longest scripted fault to notification delay, or -1 */
+    gboolean quiet;                 /* Events must cause no icon update, history entry or main loop work */
+} Scenario;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+/* The thermal and fan scenarios are faults the plugin does not report. They
+ * run with the low voltage alarm latched in the fixture, so that a handler
+ * reading the alarm of the wrong device would raise it, and must leave no
+ * trace - no notification, icon update, history entry or scheduled source.
+ *
+ * In the resume scenario the alarm goes away while the board is suspended,
+ * with no uevent to say so, and the resync on resume must clear it. Sysfs
+ * is reached by its class path there, as the resync lists it */
+static const Scenario scenarios[] = {
+    { "voltage-droop", {
+        "0 write /sys" HWMON_PATH "/in0_lcrit_alarm 0",
+        "0 uevent ACTION=change SUBSYSTEM=hwmon DEVPATH=" HWMON_PATH,
+        "1000 uevent ACTION=change SUBSYSTEM=hwmon DEVPATH=" HWMON_PATH,
+        "2000 fault",
+        "2000 write /sys" HWMON_PATH "/in0_lcrit_alarm 1",
+        "2250 uevent ACTION=change SUBSYSTEM=hwmon DEVPATH=" HWMON_PATH,
+        "5000 write /sys" HWMON_PATH "/in0_lcrit_alarm 0",
+        "5000 uevent ACTION=change SUBSYSTEM=hwmon DEVPATH=" HWMON_PATH,
+        "6000 write /sys" HWMON_PATH "/in0_lcrit_alarm 1",
+        "6000 uevent ACTION=change SUBSYSTEM=hwmon DEVPATH=" HWMON_PATH,
+        NULL }, DEDUPED (1, 2), 0x01, 500, FALSE },
+
+    { "overcurrent-two-ports", {
+        "0 write /sys/" PORT1 "/disable 1",
+        "0 write /sys/" PORT2 "/disable 1",
+        "0 fault",
+        "100 uevent ACTION=change SUBSYSTEM=usb DEVPATH=/" HUB_PATH " OVER_CURRENT_PORT=" PORT1 " OVER_CURRENT_COUNT=1",
+        "3000 uevent ACTION=change SUBSYSTEM=usb DEVPATH=/" HUB_PATH " OVER_CURRENT_PORT=" PORT2 " OVER_CURRENT_COUNT=1",
+        "8000 uevent ACTION=change SUBSYSTEM=usb DEVPATH=/" HUB_PATH " OVER_CURRENT_PORT=" PORT1 " OVER_CURRENT_COUNT=2",
+        "20000 uevent ACTION=change SUBSYSTEM=usb DEVPATH=/" HUB_PATH " OVER_CURRENT_PORT=" PORT1 " OVER_CURRENT_COUNT=3",
+        NULL }, DEDUPED (2, 3), 0x02, 200, FALSE },
+
+    { "brownout-3a", {
+        "0 write " DT_POWER "max_current u32:3000",
+        "0 write " DT_POWER "power_reset u32:2",
+        "0 fault",
+        "0 boot",
+        NULL }, 2, 0x04, 0, FALSE },
+
+    { "thermal-ramp", {
+        "0 write /sys" HWMON_PATH "/in0_lcrit_alarm 1",
+        "0 write /sys" THERMAL "/temp 60000",
+        "0 uevent ACTION=change SUBSYSTEM=thermal DEVPATH=" THERMAL,
+        "5000 write /sys" THERMAL "/temp 75000",
+        "5000 uevent ACTION=change SUBSYSTEM=thermal DEVPATH=" THERMAL,
+        "10000 fault",
+        "10000 write /sys" THERMAL "/temp 85000",
+        "10000 uevent ACTION=change SUBSYSTEM=thermal DEVPATH=" THERMAL,
+        NULL }, 0, 0, -1, TRUE },
+
+    { "fan-stall", {
+        "0 write /sys" HWMON_PATH "/in0_lcrit_alarm 1",
+        "0 write /sys" FAN_PATH "/fan1_input 3000",
+        "0 uevent ACTION=change SUBSYSTEM=hwmon DEVPATH=" FAN_PATH,
+        "2000 fault",
+        "2000 write /sys" FAN_PATH "/fan1_input 0",
+        "2000 uevent ACTION=change SUBSYSTEM=hwmon DEVPATH=" FAN_PATH,
+        NULL }, 0, 0, -1, TRUE },
+
+    { "resume-clears-alarm", {
+        "0 fault",
+        "0 write /sys" HWMON_CLASS "/in0_lcrit_alarm 1",
+        "0 uevent ACTION=change SUBSYSTEM=hwmon DEVPATH=" HWMON_CLASS,
+        "1000 sleep",
+        "1000 write /sys" HWMON_CLASS "/in0_lcrit_alarm 0",
+        "60000 resume",
+        NULL }, 1, 0, 0, FALSE }
+};
+
+static char *root;                  /* Fixture directory while a scenario runs */
+static gint64 vclock;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static gboolean write_fixture (const char *path, const char *value);
+static int remove_entry (const char *path, const struct stat *, int, struct FTW *);
+static void send_uevent (PowerPlugin *pt, char *args, guint64 seqnum);
+static char *check_quiet (PowerPlugin *pt, guint64 icon_calls, int hist_count, guint64 wakeups);
+static gboolean run_scenario (PowerPlugin *pt, const Scenario *sc);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Clock and path hooks used by the plugin - both pass through when idle */
+
+gint64 scenario_now (void)
+{
+    return root ? vclock : g_get_monotonic_time ();
+}
+
+const char *scenario_path (const char *path)
+{
+    static char buf[PATH_MAX];
+
+    if (!root) return path;
+    g_snprintf (buf, sizeof (buf), "%s%s", root, path);
+    return buf;
+}
+
+/* Fixture filesystem */
+
+static gboolean write_fixture (const char *path, const char *value)
+{
+    char *file = g_build_filename (root, path, NULL), *dir = g_path_get_dirname (file);
+    unsigned char cell[4];
+    guint32 val;
+    gboolean res;
+
+    g_mkdir_with_parents (dir, 0755);
+    if (!strncmp (value, "u32:", 4))
+    {
+        /* Device tree cells are big-endian */
+        val = strtoul (value + 4, NULL, 10);
+        cell[0] = val >> 24;
+        cell[1] = val >> 16;
+        cell[2] = val >> 8;
+        cell[3] = val;
+        res = g_file_set_contents (file, (const char *) cell, sizeof (cell), NULL);
+    }
+    else res = g_file_set_contents (file, value, -1, NULL);
+
+    g_free (dir);
+    g_free (file);
+    return res;
+}
+
+static int remove_entry (const char *path, const struct stat *, int, struct FTW *)
+{
+    return remove (path);
+}
+
+/* A fixture directory, which the plugin reads in place of the real paths
+ * until it is ended, at the start of virtual time */
+gboolean scenario_fixture_begin (void)
+{
+    if (root) return FALSE;
+    root = g_dir_make_tmp ("pplug-power-XXXXXX", NULL);
+    vclock = SCENARIO_EPOCH;
+    return root != NULL;
+}
+
+gboolean scenario_fixture_write (const char *path, const char *value)
+{
+    return root && write_fixture (path, value);
+}
+
+void scenario_fixture_end (void)
+{
+    if (!root) return;
+    nftw (root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    g_free (root);
+    root = NULL;
+}
+
+/* Virtual time moves on only when told to, outside the scripted scenarios */
+void scenario_fixture_advance (gint64 usec)
+{
+    if (root) vclock += usec;
+}
+
+/* Turn space-separated KEY=value pairs into a uevent payload and handle it */
+static void send_uevent (PowerPlugin *pt, char *args, guint64 seqnum)
+{
+    char buf[UEVENT_PAYLOAD_MAX], *ptr = buf, *end = buf + sizeof (buf), *tok, *save;
+    PowerUevent ev;
+
+    for (tok = strtok_r (args, " ", &save); tok && ptr < end; tok = strtok_r (NULL, " ", &save))
+        ptr += g_snprintf (ptr, end - ptr, "%s", tok) + 1;
+    if (ptr < end) ptr += g_snprintf (ptr, end - ptr, "SEQNUM=%" G_GUINT64_FORMAT, seqnum) + 1;
+
+    replay_parse (buf, MIN (ptr, end) - buf, &ev);
+    ev.recv_time = vclock;
+    power_uevent (pt, &ev);
+}
+
+/* Anything the events scheduled is run, and counts as a wakeup */
+static char *check_quiet (PowerPlugin *pt, guint64 icon_calls, int hist_count, guint64 wakeups)
+{
+    while (g_main_context_pending (NULL)) g_main_context_iteration (NULL, FALSE);
+
+    if (stats_get_calls (STAT_UPDATE_ICON) != icon_calls)
+        return g_strdup_printf ("%" G_GUINT64_FORMAT " icon updates, expected none", stats_get_calls (STAT_UPDATE_ICON) - icon_calls);
+    if (pt->hist_count != hist_count) return g_strdup_printf ("%d history entries, expected none", pt->hist_count - hist_count);
+    if (stats_get_wakeups () != wakeups)
+        return g_strdup_printf ("%" G_GUINT64_FORMAT " wakeups, expected none", stats_get_wakeups () - wakeups);
+    return NULL;
+}
+
+static gboolean run_scenario (PowerPlugin *pt, const Scenario *sc)
+{
+    guint64 notified = stats_get_count (COUNT_NOTIFY), count, icon_calls, wakeups;
+    gint64 onset = 0, delay = -1, cpu;
+    struct timespec ts;
+    char cmd[16], *args, *value, *err = NULL;
+    int i, ms, pos, hist_count;
+
+    if (!scenario_fixture_begin ())
+    {
+        g_warning ("power: cannot create fixture directory for scenario %s", sc->name);
+        return FALSE;
+    }
+
+    /* Start from a clean state */
+    pt->show_icon = 0;
+    pt->last_oc = -1;
+    pt->lv_time = 0;
+    pt->oc_time = 0;
+
+    /* Settle anything left over from the last scenario before taking the baselines */
+    while (g_main_context_pending (NULL)) g_main_context_iteration (NULL, FALSE);
+    icon_calls = stats_get_calls (STAT_UPDATE_ICON);
+    hist_count = pt->hist_count;
+    wakeups = stats_get_wakeups ();
+
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    cpu = ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+
+    for (i = 0; sc->steps[i] && !err; i++)
+    {
+        if (sscanf (sc->steps[i], "%d %15s %n", &ms, cmd, &pos) < 2)
+        {
+            err = g_strdup_printf ("bad step \"%s\"", sc->steps[i]);
+            break;
+        }
+        vclock = SCENARIO_EPOCH + ms * 1000LL;
+        args = g_strdup (sc->steps[i] + pos);
+
+        if (!strcmp (cmd, "write"))
+        {
+            value = strchr (args, ' ');
+            if (value) *value++ = 0;
+            if (!value || !write_fixture (args, value)) err = g_strdup_printf ("cannot write %s", args);
+        }
+        else if (!strcmp (cmd, "uevent")) send_uevent (pt, args, i);
+        else if (!strcmp (cmd, "boot")) power_boot_checks (pt);
+        else if (!strcmp (cmd, "sleep")) power_prepare_sleep (pt, TRUE);
+        else if (!strcmp (cmd, "resume")) power_prepare_sleep (pt, FALSE);
+        else if (!strcmp (cmd, "fault")) onset = vclock;
+        else err = g_strdup_printf ("unknown command %s", cmd);
+        g_free (args);
+
+        if (onset && delay < 0 && stats_get_count (COUNT_NOTIFY) > notified) delay = (vclock - onset) / 1000;
+    }
+
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    cpu = ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000 - cpu;
+
+    if (!err && sc->quiet) err = check_quiet (pt, icon_calls, hist_count, wakeups);
+    scenario_fixture_end ();
+    power_update_display (pt);
+
+    count = stats_get_count (COUNT_NOTIFY) - notified;
+    if (!err && count != sc->notifications)
+        err = g_strdup_printf ("%" G_GUINT64_FORMAT " notifications, expected %" G_GUINT64_FORMAT, count, sc->notifications);
+    if (!err && pt->show_icon != sc->conditions)
+        err = g_strdup_printf ("conditions 0x%02x, expected 0x%02x", pt->show_icon, sc->conditions);
+    if (!err && sc->delay_ms >= 0 && (delay < 0 || delay > sc->delay_ms))
+        err = g_strdup_printf ("scripted delay %" G_GINT64_FORMAT " ms, expected at most %d ms", delay, sc->delay_ms);
+
+    if (err) g_message ("power: scenario %s failed - %s", sc->name, err);
+    else g_message ("power: scenario %-22s passed - %" G_GUINT64_FORMAT " notifications, conditions 0x%02x, "
+        "scripted delay %" G_GINT64_FORMAT " ms, %" G_GINT64_FORMAT " us cpu", sc->name, count, pt->show_icon, delay, cpu);
+    g_free (err);
+    return err == NULL;
+}
+
+/* Names is "all" or a comma-separated list of scenarios; passes if every
+ * scenario named was found and passed */
+gboolean scenario_run (PowerPlugin *pt, const char *names)
+{
+    char **list = g_strsplit (names, ",", -1);
+    int i, j, run = 0, passed = 0;
+
+    for (i = 0; i < (int) G_N_ELEMENTS (scenarios); i++)
+    {
+        for (j = 0; list[j]; j++)
+            if (!strcmp (list[j], "all") || !strcmp (list[j], scenarios[i].name)) break;
+        if (!list[j]) continue;
+
+        run++;
+        if (run_scenario (pt, &scenarios[i])) passed++;
+    }
+
+    /* Any name other than "all" must match a scenario */
+    for (j = 0; list[j]; j++)
+    {
+        if (!strcmp (list[j], "all")) continue;
+        for (i = 0; i < (int) G_N_ELEMENTS (scenarios); i++)
+            if (!strcmp (list[j], scenarios[i].name)) break;
+        if (i == (int) G_N_ELEMENTS (scenarios))
+        {
+            g_message ("power: no scenario named %s", list[j]);
+            run++;
+        }
+    }
+
+    g_message ("power: %d of %d scenarios passed", passed, run);
+    g_strfreev (list);
+    return run > 0 && passed == run;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
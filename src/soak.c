@@ -0,0 +1,228 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+/* Soak test - a simulated week of faults, run against the virtual clock in a
+ * few seconds. Low voltage comes and goes every hour, overcurrent is reported
+ * on a rotating set of twice as many ports as are kept, and the board comes
+ * back from a brownout once a day. Energy readings arrive every minute, each
+ * naming a rail not seen before as well as the usual ones. After every
+ * simulated minute the event history, the port table and the buffers owned
+ * by the plugin are checked against their bounds, which must hold however
+ * long the panel runs, and at the end of each day the process's resident set
+ * must not have grown by more than the budget since the end of the first */
+
+#include <string.h>
+#include <glib/gi18n.h>
+
+#ifdef POWER_HARNESS
+#include "harness.h"
+#elif defined (LXPLUG)
+#include "plugin.h"
+#else
+#include "lxutils.h"
+#endif
+
+#include "budget.h"
+#include "power.h"
+#include "replay.h"
+#include "stats.h"
+#include "energy.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define SOAK_HWMON  "/devices/platform/soc/soc:firmware/raspberrypi-hwmon/hwmon/hwmon1"
+#define SOAK_HUB    "/devices/platform/axi/1000120000.pcie/1f00200000.usb/xhci-hcd.0/usb1/1-1"
+#define SOAK_PORTS  (OC_PORTS * 2)
+
+#define MINUTE      (60 * G_USEC_PER_SEC)
+#define DAY_MINUTES (24 * 60)
+
+/* A PMIC reading with the rails of a Raspberry Pi 5 and one more */
+#define SOAK_ADC    " EXT5V_V volt(24)=5.10000000V\n 3V3_SYS_A current(13)=0.20000000A\n 3V3_SYS_V volt(5)=3.31000000V\n" \
+                    " VDD_CORE_A current(7)=1.50000000A\n VDD_CORE_V volt(15)=0.72000000V\n EXTRA%d_A current(0)=0.01000000A\n" \
+                    " EXTRA%d_V volt(0)=1.80000000V\n"
+
+typedef struct
+{
+    guint64 seqnum;
+    guint64 events;
+    int max_history;
+    int max_ports;
+    gsize max_memory;
+    long base_rss;                  /* Resident set in kB at the end of the first day */
+    long max_growth;
+} Soak;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static void send_event (PowerPlugin *pt, Soak *s, const char *subsystem, const char *port, int count, const char *alarm);
+static void run_minute (PowerPlugin *pt, Soak *s, int minute);
+static gboolean check_rss (Soak *s, int minute);
+static gboolean check_bounds (PowerPlugin *pt, Soak *s, int minute);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* The alarm state is carried in the event, as a recording would have it, so
+ * that nothing needs writing to the fixture */
+static void send_event (PowerPlugin *pt, Soak *s, const char *subsystem, const char *port, int count, const char *alarm)
+{
+    char path[64], num[16];
+    PowerUevent ev;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.action = "change";
+    ev.subsystem = subsystem;
+    ev.alarm = alarm;
+    ev.seqnum = ++s->seqnum;
+    ev.recv_time = scenario_now ();
+    if (port)
+    {
+        g_snprintf (path, sizeof (path), "%s/1-1:1.0/%s", SOAK_HUB + 1, port);
+        g_snprintf (num, sizeof (num), "%d", count);
+        ev.devpath = SOAK_HUB;
+        ev.oc_port = path;
+        ev.oc_count = num;
+    }
+    else ev.devpath = SOAK_HWMON;
+
+    power_uevent (pt, &ev);
+    s->events++;
+}
+
+static void run_minute (PowerPlugin *pt, Soak *s, int minute)
+{
+    char port[16];
+#ifdef ENERGY_MONITOR
+    char adc[sizeof (SOAK_ADC) + 16];
+#endif
+    int visit;
+
+    if (minute % 60 == 0) send_event (pt, s, "hwmon", NULL, 0, "1");
+    if (minute % 60 == 5) send_event (pt, s, "hwmon", NULL, 0, "0");
+
+    if (minute % 20 == 10)
+    {
+        visit = minute / 20;
+        g_snprintf (port, sizeof (port), "1-1-port%d", visit % SOAK_PORTS + 1);
+        send_event (pt, s, "usb", port, visit / SOAK_PORTS + 1, "1");
+    }
+
+    if (minute % DAY_MINUTES == DAY_MINUTES / 2) power_boot_checks (pt);
+
+#ifdef ENERGY_MONITOR
+    g_snprintf (adc, sizeof (adc), SOAK_ADC, minute, minute);
+    energy_sample (adc, scenario_now ());
+#endif
+
+    /* Let anything the events scheduled, such as the second attribution scan, run */
+    while (g_main_context_pending (NULL)) g_main_context_iteration (NULL, FALSE);
+}
+
+/* The first day takes the one-off allocations, such as icons, translations
+ * and the state file, so the resident set is measured from its end */
+static gboolean check_rss (Soak *s, int minute)
+{
+    long rss;
+
+    if (minute % DAY_MINUTES != DAY_MINUTES - 1) return TRUE;
+    rss = power_resident_kb ();
+    if (rss < 0) return TRUE;
+    if (minute < DAY_MINUTES)
+    {
+        s->base_rss = rss;
+        return TRUE;
+    }
+
+    s->max_growth = MAX (s->max_growth, rss - s->base_rss);
+    if (rss - s->base_rss <= MEM_BUDGET_KB) return TRUE;
+    g_message ("power: soak day %d - resident set grew by %ld kB, over the %d kB budget", minute / DAY_MINUTES + 1,
+        rss - s->base_rss, MEM_BUDGET_KB);
+    return FALSE;
+}
+
+static gboolean check_bounds (PowerPlugin *pt, Soak *s, int minute)
+{
+    gsize memory = power_memory ();
+
+    s->max_history = MAX (s->max_history, pt->hist_count);
+    s->max_ports = MAX (s->max_ports, pt->num_oc_ports);
+    s->max_memory = MAX (s->max_memory, memory);
+
+    if (pt->hist_count <= HISTORY_LEN && pt->num_oc_ports <= OC_PORTS && memory <= MEM_BUDGET) return check_rss (s, minute);
+    g_message ("power: soak minute %d - history %d of %d, ports %d of %d, buffers %zu of %d bytes", minute,
+        pt->hist_count, HISTORY_LEN, pt->num_oc_ports, OC_PORTS, memory, MEM_BUDGET);
+    return FALSE;
+}
+
+gboolean soak_run (PowerPlugin *pt, int days)
+{
+    guint64 notified = stats_get_count (COUNT_NOTIFY);
+    Soak s;
+    gboolean passed = TRUE;
+    int minute;
+
+    memset (&s, 0, sizeof (s));
+    if (days <= 0 || !scenario_fixture_begin ()) return FALSE;
+
+    /* A 3A supply and a brownout reset, so that each boot check adds to the history */
+    if (!scenario_fixture_write ("/proc/device-tree/chosen/power/max_current", "u32:3000")
+        || !scenario_fixture_write ("/proc/device-tree/chosen/power/power_reset", "u32:2"))
+    {
+        scenario_fixture_end ();
+        return FALSE;
+    }
+
+    for (minute = 0; minute < days * DAY_MINUTES && passed; minute++)
+    {
+        run_minute (pt, &s, minute);
+        passed = check_bounds (pt, &s, minute);
+        scenario_fixture_advance (MINUTE);
+    }
+    scenario_fixture_end ();
+
+    g_message ("power: soak of %d days, %" G_GUINT64_FORMAT " events, %" G_GUINT64_FORMAT " notifications", days,
+        s.events, stats_get_count (COUNT_NOTIFY) - notified);
+    g_message ("power: at most %d of %d history entries, %d of %d ports, %zu of %d buffer bytes", s.max_history,
+        HISTORY_LEN, s.max_ports, OC_PORTS, s.max_memory, MEM_BUDGET);
+    g_message ("power: resident set grew by at most %ld kB after the first day", s.max_growth);
+
+    /* The bounds are only tested if they were reached */
+    if (passed && (s.max_history < HISTORY_LEN || s.max_ports < OC_PORTS))
+    {
+        g_message ("power: soak did not fill the history and port table");
+        passed = FALSE;
+    }
+    return passed;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
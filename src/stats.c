@@ -0,0 +1,544 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "budget.h"
+#include "stats.h"
+
+#ifdef POWER_INSTRUMENT
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Deepest nesting of instrumented calls that is attributed correctly */
+#define STAT_DEPTH 8
+
+/* Log-linear histogram - each power of two is split into HIST_SUB linear
+ * buckets, from 1ns up to HIST_MAX_LOG2 ns (about a minute). The histograms
+ * come from the statistics share of the memory budget, which at 64 kB allows
+ * 12.5% resolution and below that 25% */
+#if MEM_BUDGET_KB >= 64
+#define HIST_SUB_LOG2   3
+#else
+#define HIST_SUB_LOG2   2
+#endif
+#define HIST_SUB        (1 << HIST_SUB_LOG2)
+#define HIST_MAX_LOG2   36
+#define HIST_BUCKETS    ((HIST_MAX_LOG2 - HIST_SUB_LOG2 + 2) * HIST_SUB)
+
+/* Distinct wakeup sources tracked by name */
+#define WAKE_SOURCES 16
+
+/* Default longest dispatch in msec before it is logged as a stall - one frame at 60Hz */
+#define STALL_BUDGET_MS 16
+
+typedef struct
+{
+    guint64 calls;
+    gint64 total_ns;
+    gint64 max_ns;
+    guint64 spawns;                 /* Child processes started */
+    guint64 allocs;                 /* Heap allocations, if counted */
+} StatCounter;
+
+/* Per-thread allocation count exported by the pplug-power-alloccount preload,
+ * or by the test harness, which links the counter in */
+typedef unsigned long (*AllocCountFunc) (void);
+
+typedef struct
+{
+    guint32 buckets[HIST_BUCKETS];
+    guint64 count;
+    gint64 max_ns;
+} Histogram;
+
+/* Main loop wakeups per source */
+typedef struct
+{
+    const char *name;
+    const char *kind;               /* fd, idle, timer or dbus */
+    guint64 wakeups;
+} WakeSource;
+
+/* Source callback wrapped for timing */
+typedef struct
+{
+    const char *name;
+    gpointer func;
+    gpointer data;
+    WakeSource *wake;
+} Dispatch;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static const char *stat_names[NUM_STATS] = {
+    "check_psu",
+    "check_brownout",
+    "check_user_warnings",
+    "check_memres",
+    "cb_overcurrent_fd",
+    "cb_lowvoltage_fd",
+    "power_uevent",
+    "update_icon"
+};
+
+static const char *hist_names[NUM_HISTS] = {
+    "event to filter",
+    "event to decision",
+    "event to notify",
+    "event to icon",
+    "sysfs read",
+    "firmware query",
+    "panel paint",
+    "paint after work"
+};
+
+static const char *count_names[NUM_COUNTS] = {
+    "notifications",
+    "stalls"
+};
+
+static StatCounter counters[NUM_STATS];
+static guint64 counts[NUM_COUNTS];
+
+/* Function durations, then the other distributions */
+static Histogram hists[NUM_STATS + NUM_HISTS];
+
+/* Stack of instrumented calls in progress, so spawns go to the innermost */
+static StatId active[STAT_DEPTH];
+static guint64 active_allocs[STAT_DEPTH];
+static int depth;
+
+static AllocCountFunc alloc_count;
+static gboolean alloc_looked_up;
+
+static WakeSource wake_sources[WAKE_SOURCES];
+static int num_wake_sources;
+
+_Static_assert (sizeof (hists) + sizeof (counters) + sizeof (counts) + sizeof (wake_sources) <= (gsize) MEM_SHARE (MEM_STATS),
+    "statistics do not fit their share of the memory budget");
+
+/* Dispatch in progress, and the slowest instrumented call within it */
+static const char *dispatch_name;
+static const char *slow_phase;
+static gint64 slow_phase_ns;
+static gint64 stall_budget_ns = -1;
+
+/* Main thread time spent in the plugin's own sources */
+static gint64 dispatch_total_ns;
+static gboolean dispatched;         /* Since the last paint */
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+gint64 stats_now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Histograms */
+
+static int hist_bucket (gint64 ns)
+{
+    int msb;
+
+    if (ns < HIST_SUB) return ns < 0 ? 0 : ns;
+    msb = 63 - __builtin_clzll (ns);
+    if (msb > HIST_MAX_LOG2) return HIST_BUCKETS - 1;
+    return (msb - HIST_SUB_LOG2 + 1) * HIST_SUB + ((ns >> (msb - HIST_SUB_LOG2)) & (HIST_SUB - 1));
+}
+
+/* Upper bound of the values counted in a bucket */
+static gint64 bucket_value (int bucket)
+{
+    int msb;
+
+    if (bucket < HIST_SUB) return bucket;
+    msb = bucket / HIST_SUB + HIST_SUB_LOG2 - 1;
+    return ((gint64) (HIST_SUB + bucket % HIST_SUB + 1) << (msb - HIST_SUB_LOG2)) - 1;
+}
+
+static void hist_add (Histogram *h, gint64 ns)
+{
+    h->buckets[hist_bucket (ns)]++;
+    h->count++;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+static gint64 hist_percentile (const Histogram *h, int percent)
+{
+    guint64 target = (h->count * percent + 99) / 100, seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= target) return MIN (bucket_value (i), h->max_ns);
+    }
+    return h->max_ns;
+}
+
+void stats_hist_add (HistId id, gint64 ns)
+{
+    hist_add (&hists[NUM_STATS + id], ns);
+}
+
+/* Per-frame work probe - the time the panel takes to paint each frame, with
+ * the paints that follow plugin work on the main thread counted again
+ * separately. This is not a measure of the panel with and without the plugin:
+ * the plugin's own work is done in its dispatches before the paint, and is
+ * timed by the function statistics and the stall log */
+void stats_paint (gint64 ns)
+{
+    hist_add (&hists[NUM_STATS + HIST_PAINT], ns);
+    if (dispatched) hist_add (&hists[NUM_STATS + HIST_PAINT_AFTER_WORK], ns);
+    dispatched = FALSE;
+}
+
+static gint64 cpu_time_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Allocation accounting - counts come from an LD_PRELOAD library that wraps
+ * the C library allocators, since a dlopened module cannot interpose the
+ * panel's allocator itself; the test harness links the same wrappers in.
+ * Without either, no allocations are counted */
+
+static guint64 allocs_now (void)
+{
+    if (!alloc_looked_up)
+    {
+        alloc_count = (AllocCountFunc) dlsym (RTLD_DEFAULT, "pplug_power_alloc_count");
+        alloc_looked_up = TRUE;
+    }
+    return alloc_count ? alloc_count () : 0;
+}
+
+gboolean stats_allocs_counted (void)
+{
+    allocs_now ();
+    return alloc_count != NULL;
+}
+
+/* Instrumented functions */
+
+static WakeSource *find_wake_source (const char *name, const char *kind);
+
+gint64 stats_begin (StatId id)
+{
+    if (depth < STAT_DEPTH)
+    {
+        active[depth] = id;
+        active_allocs[depth] = allocs_now ();
+    }
+    depth++;
+    return stats_now_ns ();
+}
+
+void stats_end (StatId id, gint64 start)
+{
+    gint64 elapsed = stats_now_ns () - start;
+
+    counters[id].calls++;
+    counters[id].total_ns += elapsed;
+    if (elapsed > counters[id].max_ns) counters[id].max_ns = elapsed;
+    hist_add (&hists[id], elapsed);
+    if (depth > 0 && depth <= STAT_DEPTH) counters[id].allocs += allocs_now () - active_allocs[depth - 1];
+    if (depth > 0) depth--;
+
+    if (dispatch_name && elapsed > slow_phase_ns)
+    {
+        slow_phase = stat_names[id];
+        slow_phase_ns = elapsed;
+    }
+}
+
+void stats_spawn (void)
+{
+    if (depth > 0 && depth <= STAT_DEPTH) counters[active[depth - 1]].spawns++;
+}
+
+void stats_count (CountId id)
+{
+    counts[id]++;
+}
+
+guint64 stats_get_calls (StatId id)
+{
+    return counters[id].calls;
+}
+
+guint64 stats_get_allocs (StatId id)
+{
+    return counters[id].allocs;
+}
+
+guint64 stats_get_spawns (StatId id)
+{
+    return counters[id].spawns;
+}
+
+guint64 stats_get_count (CountId id)
+{
+    return counts[id];
+}
+
+/* Stall detection - every dispatch of a source the plugin adds is timed, and
+ * any that exceeds the budget (POWER_STALL_MS in the environment) is logged
+ * with the slowest instrumented function it called */
+
+static gint64 dispatch_begin (const char *name)
+{
+    const char *env;
+
+    if (stall_budget_ns < 0)
+    {
+        env = g_getenv ("POWER_STALL_MS");
+        stall_budget_ns = (env ? atoi (env) : STALL_BUDGET_MS) * 1000000LL;
+    }
+
+    dispatch_name = name;
+    slow_phase = NULL;
+    slow_phase_ns = 0;
+    return stats_now_ns ();
+}
+
+static void dispatch_end (gint64 start)
+{
+    gint64 elapsed = stats_now_ns () - start;
+
+    dispatch_total_ns += elapsed;
+    dispatched = TRUE;
+    if (elapsed > stall_budget_ns)
+    {
+        counts[COUNT_STALL]++;
+        g_warning ("power: %s took %" G_GINT64_FORMAT " us, over budget of %" G_GINT64_FORMAT " us%s%s",
+            dispatch_name, elapsed / 1000, stall_budget_ns / 1000, slow_phase ? " - slowest phase " : "",
+            slow_phase ? slow_phase : "");
+    }
+    dispatch_name = NULL;
+}
+
+static gboolean dispatch_fd (gint fd, GIOCondition cond, gpointer user_data)
+{
+    Dispatch *d = (Dispatch *) user_data;
+    gint64 start;
+    gboolean res;
+
+    if (d->wake) d->wake->wakeups++;
+    start = dispatch_begin (d->name);
+    res = ((GUnixFDSourceFunc) d->func) (fd, cond, d->data);
+
+    dispatch_end (start);
+    return res;
+}
+
+static gboolean dispatch_source (gpointer user_data)
+{
+    Dispatch *d = (Dispatch *) user_data;
+    gint64 start;
+    gboolean res;
+
+    if (d->wake) d->wake->wakeups++;
+    start = dispatch_begin (d->name);
+    res = ((GSourceFunc) d->func) (d->data);
+
+    dispatch_end (start);
+    return res;
+}
+
+static Dispatch *new_dispatch (gpointer func, gpointer data, const char *name, const char *kind)
+{
+    Dispatch *d = g_new (Dispatch, 1);
+
+    d->name = name;
+    d->func = func;
+    d->data = data;
+    d->wake = find_wake_source (name, kind);
+    return d;
+}
+
+guint stats_fd_add (gint fd, GIOCondition cond, GUnixFDSourceFunc func, gpointer data, const char *name)
+{
+    return g_unix_fd_add_full (G_PRIORITY_DEFAULT, fd, cond, dispatch_fd, new_dispatch (func, data, name, "fd"), g_free);
+}
+
+guint stats_idle_add (GSourceFunc func, gpointer data, const char *name)
+{
+    return g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, dispatch_source, new_dispatch (func, data, name, "idle"), g_free);
+}
+
+guint stats_timeout_add (guint ms, GSourceFunc func, gpointer data, const char *name)
+{
+    return g_timeout_add_full (G_PRIORITY_DEFAULT, ms, dispatch_source, new_dispatch (func, data, name, "timer"), g_free);
+}
+
+/* Wakeup accounting - the plugin is meant to be entirely event driven, so
+ * with no faults present it should not wake the panel at all */
+
+static WakeSource *find_wake_source (const char *name, const char *kind)
+{
+    int i;
+
+    for (i = 0; i < num_wake_sources; i++)
+        if (!strcmp (wake_sources[i].name, name)) return &wake_sources[i];
+    if (num_wake_sources == WAKE_SOURCES) return NULL;
+
+    wake_sources[num_wake_sources].name = name;
+    wake_sources[num_wake_sources].kind = kind;
+    return &wake_sources[num_wake_sources++];
+}
+
+/* For callbacks dispatched by someone else's source, such as D-Bus signals,
+ * which are timed against the stall budget like the plugin's own. One run
+ * from within a dispatch already being timed is only counted */
+gint64 stats_dispatch_begin (const char *name)
+{
+    WakeSource *w = find_wake_source (name, "dbus");
+
+    if (w) w->wakeups++;
+    dispatched = TRUE;
+    return dispatch_name ? -1 : dispatch_begin (name);
+}
+
+void stats_dispatch_end (gint64 start)
+{
+    if (start >= 0) dispatch_end (start);
+}
+
+/* Wakeups from all of the plugin's sources */
+guint64 stats_get_wakeups (void)
+{
+    guint64 total = 0;
+    int i;
+
+    for (i = 0; i < num_wake_sources; i++) total += wake_sources[i].wakeups;
+    return total;
+}
+
+/* Wakeups from the source or callback of the given name */
+guint64 stats_get_source_wakeups (const char *name)
+{
+    int i;
+
+    for (i = 0; i < num_wake_sources; i++)
+        if (!strcmp (wake_sources[i].name, name)) return wake_sources[i].wakeups;
+    return 0;
+}
+
+void stats_wakeup_report (void)
+{
+    int i;
+
+    for (i = 0; i < num_wake_sources; i++)
+        g_message ("power: %-20s %-6s %8" G_GUINT64_FORMAT " wakeups", wake_sources[i].name, wake_sources[i].kind,
+            wake_sources[i].wakeups);
+}
+
+gsize stats_memory (void)
+{
+    return sizeof (hists) + sizeof (counters) + sizeof (counts) + sizeof (wake_sources);
+}
+
+/* Latency table for display - ownership passes to the caller */
+char *stats_summary (void)
+{
+    GString *str = g_string_new (NULL);
+    const Histogram *h;
+    int i;
+
+    g_string_append_printf (str, "%-20s %8s %10s %10s %10s %10s\n", "", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for (i = 0; i < NUM_STATS + NUM_HISTS; i++)
+    {
+        h = &hists[i];
+        if (!h->count) continue;
+        g_string_append_printf (str, "%-20s %8" G_GUINT64_FORMAT " %10.1f %10.1f %10.1f %10.1f\n",
+            i < NUM_STATS ? stat_names[i] : hist_names[i - NUM_STATS], h->count, hist_percentile (h, 50) / 1e3,
+            hist_percentile (h, 90) / 1e3, hist_percentile (h, 99) / 1e3, h->max_ns / 1e3);
+    }
+    for (i = 0; i < NUM_COUNTS; i++)
+        g_string_append_printf (str, "%-20s %8" G_GUINT64_FORMAT "\n", count_names[i], counts[i]);
+    g_string_append_printf (str, "%-20s %8" G_GINT64_FORMAT " ms (plugin %" G_GINT64_FORMAT " ms)\n", "process cpu",
+        cpu_time_ns () / 1000000, dispatch_total_ns / 1000000);
+    for (i = 0; i < num_wake_sources; i++)
+        g_string_append_printf (str, "%-20s %8" G_GUINT64_FORMAT " wakeups (%s)\n", wake_sources[i].name,
+            wake_sources[i].wakeups, wake_sources[i].kind);
+
+    return g_string_free (str, FALSE);
+}
+
+void stats_report (void)
+{
+    StatCounter *c;
+    const Histogram *h;
+    int i;
+
+    for (i = 0; i < NUM_STATS; i++)
+    {
+        c = &counters[i];
+        if (!c->calls) continue;
+        g_message ("power: %-20s %8" G_GUINT64_FORMAT " calls %10" G_GINT64_FORMAT " ns/call %10" G_GINT64_FORMAT
+            " ns max %6" G_GUINT64_FORMAT " spawns %8" G_GUINT64_FORMAT " allocs", stat_names[i], c->calls,
+            c->total_ns / (gint64) c->calls, c->max_ns, c->spawns, c->allocs);
+    }
+
+    for (i = 0; i < NUM_HISTS; i++)
+    {
+        h = &hists[NUM_STATS + i];
+        if (!h->count) continue;
+        g_message ("power: %-20s %8" G_GUINT64_FORMAT " samples %10.1f us p50 %10.1f us p99 %10.1f us max",
+            hist_names[i], h->count, hist_percentile (h, 50) / 1e3, hist_percentile (h, 99) / 1e3, h->max_ns / 1e3);
+    }
+
+    for (i = 0; i < NUM_COUNTS; i++)
+        if (counts[i]) g_message ("power: %-20s %8" G_GUINT64_FORMAT, count_names[i], counts[i]);
+
+    g_message ("power: %" G_GINT64_FORMAT " ms process cpu, %" G_GINT64_FORMAT " ms in plugin sources",
+        cpu_time_ns () / 1000000, dispatch_total_ns / 1000000);
+}
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,142 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#ifndef POWER_STATS_H
+#define POWER_STATS_H
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Instrumented functions */
+typedef enum
+{
+    STAT_CHECK_PSU,
+    STAT_CHECK_BROWNOUT,
+    STAT_CHECK_USER_WARNINGS,
+    STAT_CHECK_MEMRES,
+    STAT_CB_OVERCURRENT,
+    STAT_CB_LOWVOLTAGE,
+    STAT_UEVENT,
+    STAT_UPDATE_ICON,
+    NUM_STATS
+} StatId;
+
+/* Latency distributions other than function durations */
+typedef enum
+{
+    HIST_EVENT_FILTER,              /* Event timestamp to passing the filter */
+    HIST_EVENT_DECISION,            /* Event timestamp to alarm decision */
+    HIST_EVENT_NOTIFY,              /* Event timestamp to notification dispatch */
+    HIST_EVENT_ICON,                /* Event timestamp to icon update - end to end */
+    HIST_SYSFS_READ,
+    HIST_FIRMWARE_QUERY,
+    HIST_PAINT,                     /* Panel paint, every frame */
+    HIST_PAINT_AFTER_WORK,          /* Panel paint in frames after plugin work */
+    NUM_HISTS
+} HistId;
+
+/* Counted events */
+typedef enum
+{
+    COUNT_NOTIFY,
+    COUNT_STALL,
+    NUM_COUNTS
+} CountId;
+
+#ifdef POWER_INSTRUMENT
+
+/* Time a function body - STAT_END must be reached on every path after STAT_BEGIN */
+#define STAT_BEGIN(id)      gint64 stat_start_ = stats_begin (id)
+#define STAT_END(id)        stats_end (id, stat_start_)
+#define STAT_CALL(id,call)  do { gint64 stat_start_ = stats_begin (id); call; stats_end (id, stat_start_); } while (0)
+#define STAT_SPAWN()        stats_spawn ()
+#define STAT_COUNT(id)      stats_count (id)
+#define STAT_HIST(id,ns)    stats_hist_add (id, ns)
+
+/* Count and time a callback run by someone else's source, such as a D-Bus
+ * signal - STAT_DISPATCH_END must be reached on every path */
+#define STAT_DISPATCH_BEGIN()   gint64 stat_dispatch_ = stats_dispatch_begin (G_STRFUNC)
+#define STAT_DISPATCH_END()     stats_dispatch_end (stat_dispatch_)
+
+/* Main loop sources whose dispatches are timed against the stall budget */
+#define POWER_FD_ADD(fd,cond,func,data)     stats_fd_add (fd, cond, func, data, #func)
+#define POWER_IDLE_ADD(func,data)           stats_idle_add (func, data, #func)
+#define POWER_TIMEOUT_ADD(ms,func,data)     stats_timeout_add (ms, func, data, #func)
+
+#else
+
+#define STAT_BEGIN(id)
+#define STAT_END(id)        do { } while (0)
+#define STAT_CALL(id,call)  call
+#define STAT_SPAWN()        do { } while (0)
+#define STAT_COUNT(id)      do { } while (0)
+#define STAT_HIST(id,ns)    do { } while (0)
+
+#define STAT_DISPATCH_BEGIN()
+#define STAT_DISPATCH_END()     do { } while (0)
+
+#define POWER_FD_ADD(fd,cond,func,data)     g_unix_fd_add (fd, cond, func, data)
+#define POWER_IDLE_ADD(func,data)           g_idle_add (func, data)
+#define POWER_TIMEOUT_ADD(ms,func,data)     g_timeout_add (ms, func, data)
+
+#endif
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+#ifdef POWER_INSTRUMENT
+extern gint64 stats_now_ns (void);
+extern gint64 stats_begin (StatId id);
+extern void stats_end (StatId id, gint64 start);
+extern void stats_spawn (void);
+extern void stats_count (CountId id);
+extern guint64 stats_get_calls (StatId id);
+extern guint64 stats_get_allocs (StatId id);
+extern guint64 stats_get_spawns (StatId id);
+extern gboolean stats_allocs_counted (void);
+extern guint64 stats_get_count (CountId id);
+extern guint stats_fd_add (gint fd, GIOCondition cond, GUnixFDSourceFunc func, gpointer data, const char *name);
+extern guint stats_idle_add (GSourceFunc func, gpointer data, const char *name);
+extern guint stats_timeout_add (guint ms, GSourceFunc func, gpointer data, const char *name);
+extern void stats_hist_add (HistId id, gint64 ns);
+extern void stats_paint (gint64 ns);
+extern gint64 stats_dispatch_begin (const char *name);
+extern void stats_dispatch_end (gint64 start);
+extern guint64 stats_get_wakeups (void);
+extern guint64 stats_get_source_wakeups (const char *name);
+extern void stats_wakeup_report (void);
+extern gsize stats_memory (void);
+extern char *stats_summary (void);
+extern void stats_report (void);
+#endif
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,376 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Synthetic uevent storms - a generator thread writes uevent payloads into
+ * one end of a socketpair at a fixed rate, and the main loop reads the other
+ * end exactly as it would a udev monitor. A timer measures how late the main
+ * loop dispatches while the storm runs, to show whether the panel stays
+ * responsive under worst-case device churn */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <glib/gi18n.h>
+#include <glib-unix.h>
+
+#ifdef POWER_HARNESS
+#include "harness.h"
+#elif defined (LXPLUG)
+#include "plugin.h"
+#else
+#include "lxutils.h"
+#endif
+
+#include "budget.h"
+#include "power.h"
+#include "replay.h"
+#include "stats.h"
+#include "uevent-file.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Interval of the main loop latency probe */
+#define PROBE_MS 10
+
+/* Events handled before the event and update paths are expected to be in a
+ * steady state - first notifications, icon loading and translations all
+ * allocate. After that, an event that raises a notification still allocates
+ * for the notification and the process attribution, so only the events that
+ * raise none are held to zero allocations; icon updates always are */
+#define WARMUP_EVENTS 100
+
+typedef enum
+{
+    STORM_USB_CHANGE,               /* Plain USB device changes, all filtered */
+    STORM_HUB_FLAP,                 /* Hub add/remove with overcurrent on its ports */
+    STORM_OC_REPEAT,                /* Overcurrent on each port with the count already seen */
+    STORM_ALARM_TOGGLE              /* hwmon low voltage alarm set and cleared */
+} StormType;
+
+typedef struct
+{
+    PowerPlugin *pt;
+    StormType type;
+    int rate;                       /* Events per second */
+    int seconds;
+    int fds[2];                     /* Main loop end, generator end */
+    GThread *thread;
+    volatile gint stop;
+    guint fd_id;
+    guint probe_id;
+    gint64 start;
+    gint64 last_probe;
+    gint sent;                      /* Written by the generator thread */
+    guint64 handled;
+    guint64 icon_calls;             /* update_icon calls before the storm */
+    guint64 notifications;          /* Notifications before the storm */
+    guint64 uevent_allocs;          /* Allocations by events raising no notification after warm-up */
+    guint64 icon_allocs;            /* Allocations on the update path at the end of warm-up */
+    gint64 *lag;                    /* Probe lateness samples in usec */
+    guint nlag;
+    guint max_lag;
+    PowerDoneFunc done;
+} Stress;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static Stress *stress;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static int make_event (StormType type, guint64 n, char *buf, size_t size);
+static gpointer generator (gpointer data);
+static gboolean cb_stress_fd (gint fd, GIOCondition cond, gpointer data);
+static gboolean cb_probe (gpointer data);
+static int compare_lag (const void *a, const void *b);
+static gboolean report (void);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Build the nth event of a storm as a NUL-separated uevent payload */
+static int make_event (StormType type, guint64 n, char *buf, size_t size)
+{
+    const char *hub = "/devices/platform/axi/1000120000.pcie/1f00200000.usb/xhci-hcd.0/usb1/1-1";
+    char *ptr = buf, *end = buf + size;
+
+#define ADD(...) if (ptr < end) ptr += g_snprintf (ptr, end - ptr, __VA_ARGS__) + 1
+
+    switch (type)
+    {
+        case STORM_USB_CHANGE :
+            ADD ("change@%s", hub);
+            ADD ("ACTION=change");
+            ADD ("DEVPATH=%s", hub);
+            ADD ("SUBSYSTEM=usb");
+            break;
+
+        case STORM_HUB_FLAP :
+            /* add, change with overcurrent, remove */
+            ADD ("%s@%s", n % 3 == 0 ? "add" : n % 3 == 1 ? "change" : "remove", hub);
+            ADD ("ACTION=%s", n % 3 == 0 ? "add" : n % 3 == 1 ? "change" : "remove");
+            ADD ("DEVPATH=%s", hub);
+            ADD ("SUBSYSTEM=usb");
+            if (n % 3 == 1)
+            {
+                ADD ("OVER_CURRENT_PORT=%s/1-1:1.0/1-1-port%d", hub + 1, (int) (n / 3) % 4 + 1);
+                ADD ("OVER_CURRENT_COUNT=%d", (int) (n / 3));
+                ADD ("PPLUG_ALARM=1");
+            }
+            break;
+
+        case STORM_OC_REPEAT :
+            /* Every event after the first passes the filter and reaches the
+             * alarm decision but raises nothing, so that path is held to zero
+             * allocations along with the filter */
+            ADD ("change@%s", hub);
+            ADD ("ACTION=change");
+            ADD ("DEVPATH=%s", hub);
+            ADD ("SUBSYSTEM=usb");
+            ADD ("OVER_CURRENT_PORT=%s/1-1:1.0/1-1-port%d", hub + 1, (int) n % 4 + 1);
+            ADD ("OVER_CURRENT_COUNT=1");
+            ADD ("PPLUG_ALARM=1");
+            break;
+
+        case STORM_ALARM_TOGGLE :
+            ADD ("change@/devices/platform/soc/soc:firmware/raspberrypi-hwmon/hwmon/hwmon1");
+            ADD ("ACTION=change");
+            ADD ("DEVPATH=/devices/platform/soc/soc:firmware/raspberrypi-hwmon/hwmon/hwmon1");
+            ADD ("SUBSYSTEM=hwmon");
+            ADD ("PPLUG_ALARM=%c", n % 2 ? '0' : '1');
+            break;
+    }
+    ADD ("SEQNUM=%" G_GUINT64_FORMAT, n);
+
+#undef ADD
+
+    return MIN (ptr, end) - buf;
+}
+
+/* Send events in 1ms batches to hold the requested rate */
+static gpointer generator (gpointer data)
+{
+    Stress *st = (Stress *) data;
+    char buf[UEVENT_PAYLOAD_MAX];
+    gint64 start = g_get_monotonic_time (), due, now;
+    guint64 n = 0, target;
+    int len;
+
+    while (!g_atomic_int_get (&st->stop))
+    {
+        now = g_get_monotonic_time ();
+        if (now - start >= (gint64) st->seconds * G_USEC_PER_SEC) break;
+
+        target = (now - start) * st->rate / G_USEC_PER_SEC;
+        while (n < target && !g_atomic_int_get (&st->stop))
+        {
+            len = make_event (st->type, n, buf, sizeof (buf));
+            if (send (st->fds[1], buf, len, MSG_NOSIGNAL) < 0 && errno != EINTR) break;
+            n++;
+        }
+        g_atomic_int_set (&st->sent, n);
+
+        due = now + 1000;
+        now = g_get_monotonic_time ();
+        if (due > now) g_usleep (due - now);
+    }
+
+    g_atomic_int_set (&st->sent, n);
+
+    /* Closing our end raises HUP on the main loop's end once it has drained */
+    close (st->fds[1]);
+    st->fds[1] = -1;
+    return NULL;
+}
+
+static gboolean cb_stress_fd (gint fd, GIOCondition cond, gpointer)
+{
+    char buf[UEVENT_PAYLOAD_MAX];
+    PowerUevent ev;
+    PowerDoneFunc done;
+    gboolean passed;
+    guint64 allocs, notified;
+    ssize_t len;
+
+    if (cond & G_IO_IN)
+    {
+        len = recv (fd, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+        if (len > 0)
+        {
+            buf[len] = 0;
+            replay_parse (buf, len, &ev);
+            allocs = stats_get_allocs (STAT_UEVENT);
+            notified = stats_get_count (COUNT_NOTIFY);
+            power_uevent (stress->pt, &ev);
+            if (++stress->handled == WARMUP_EVENTS) stress->icon_allocs = stats_get_allocs (STAT_UPDATE_ICON);
+            else if (stress->handled > WARMUP_EVENTS && stats_get_count (COUNT_NOTIFY) == notified)
+                stress->uevent_allocs += stats_get_allocs (STAT_UEVENT) - allocs;
+            return G_SOURCE_CONTINUE;
+        }
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) return G_SOURCE_CONTINUE;
+    }
+
+    stress->fd_id = 0;
+    passed = report ();
+    done = stress->done;
+    stress_stop ();
+    if (done) done (passed);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean cb_probe (gpointer)
+{
+    gint64 now = g_get_monotonic_time ();
+    gint64 lag = now - stress->last_probe - PROBE_MS * 1000;
+
+    stress->last_probe = now;
+    if (stress->nlag < stress->max_lag) stress->lag[stress->nlag++] = MAX (lag, 0);
+    return G_SOURCE_CONTINUE;
+}
+
+static int compare_lag (const void *a, const void *b)
+{
+    gint64 la = *(const gint64 *) a, lb = *(const gint64 *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+/* Fails if the event or update paths allocated once warmed up */
+static gboolean report (void)
+{
+    gint64 elapsed = g_get_monotonic_time () - stress->start;
+    gint sent = g_atomic_int_get (&stress->sent);
+    guint n = stress->nlag;
+    gboolean passed = TRUE;
+
+    g_message ("power: storm sent %d handled %" G_GUINT64_FORMAT " events in %.3f s (%.0f/s), "
+        "%" G_GUINT64_FORMAT " icon updates, %" G_GUINT64_FORMAT " notifications", sent, stress->handled, elapsed / 1e6,
+        elapsed ? stress->handled * 1e6 / elapsed : 0.0, stats_get_calls (STAT_UPDATE_ICON) - stress->icon_calls,
+        stats_get_count (COUNT_NOTIFY) - stress->notifications);
+
+    /* Steady-state event handling and icon updates must not allocate */
+    if (!stats_allocs_counted ())
+    {
+        g_message ("power: allocations are not being counted");
+        passed = FALSE;
+    }
+    else if (stress->handled <= WARMUP_EVENTS)
+    {
+        g_message ("power: storm too short to reach a steady state");
+        passed = FALSE;
+    }
+    else if (stress->uevent_allocs || stats_get_allocs (STAT_UPDATE_ICON) != stress->icon_allocs)
+    {
+        g_message ("power: steady-state allocations - %" G_GUINT64_FORMAT " on event path, %" G_GUINT64_FORMAT
+            " on update path", stress->uevent_allocs, stats_get_allocs (STAT_UPDATE_ICON) - stress->icon_allocs);
+        passed = FALSE;
+    }
+    else g_message ("power: no steady-state allocations on event or update paths");
+
+    if (!n) return passed;
+    qsort (stress->lag, n, sizeof (gint64), compare_lag);
+    g_message ("power: main loop dispatch lag us p50 %" G_GINT64_FORMAT " p99 %" G_GINT64_FORMAT " max %" G_GINT64_FORMAT,
+        stress->lag[n / 2], stress->lag[n * 99 / 100], stress->lag[n - 1]);
+    return passed;
+}
+
+/* Scenario is "usb-change", "hub-flap", "oc-repeat" or "alarm-toggle",
+ * optionally followed by ":<events per second>" and ":<seconds>" */
+void stress_start (PowerPlugin *pt, const char *scenario, PowerDoneFunc done)
+{
+    char **args;
+
+    if (stress) return;
+    stress = g_new0 (Stress, 1);
+    stress->pt = pt;
+    stress->done = done;
+    stress->fds[0] = stress->fds[1] = -1;
+    stress->rate = 10000;
+    stress->seconds = 10;
+
+    args = g_strsplit (scenario, ":", 3);
+    if (!g_strcmp0 (args[0], "usb-change")) stress->type = STORM_USB_CHANGE;
+    else if (!g_strcmp0 (args[0], "hub-flap")) stress->type = STORM_HUB_FLAP;
+    else if (!g_strcmp0 (args[0], "oc-repeat")) stress->type = STORM_OC_REPEAT;
+    else if (!g_strcmp0 (args[0], "alarm-toggle")) stress->type = STORM_ALARM_TOGGLE;
+    else
+    {
+        g_warning ("power: unknown stress scenario %s", args[0]);
+        g_strfreev (args);
+        stress_stop ();
+        if (done) done (FALSE);
+        return;
+    }
+    if (args[1]) stress->rate = MAX (1, atoi (args[1]));
+    if (args[1] && args[2]) stress->seconds = MAX (1, atoi (args[2]));
+    g_strfreev (args);
+
+    if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, stress->fds) < 0)
+    {
+        g_warning ("power: cannot create stress socket - %s", g_strerror (errno));
+        stress_stop ();
+        if (done) done (FALSE);
+        return;
+    }
+
+    stress->max_lag = stress->seconds * 1000 / PROBE_MS * 2;
+    stress->lag = g_new (gint64, stress->max_lag);
+    stress->icon_calls = stats_get_calls (STAT_UPDATE_ICON);
+    stress->notifications = stats_get_count (COUNT_NOTIFY);
+
+    stress->start = stress->last_probe = g_get_monotonic_time ();
+    stress->fd_id = POWER_FD_ADD (stress->fds[0], G_IO_IN | G_IO_HUP | G_IO_ERR, cb_stress_fd, NULL);
+    stress->probe_id = POWER_TIMEOUT_ADD (PROBE_MS, cb_probe, NULL);
+    stress->thread = g_thread_new ("power-stress", generator, stress);
+}
+
+void stress_stop (void)
+{
+    if (!stress) return;
+    g_atomic_int_set (&stress->stop, 1);
+
+    /* Unblock a generator stuck in send by closing the reading end first */
+    if (stress->fd_id) g_source_remove (stress->fd_id);
+    if (stress->fds[0] >= 0) shutdown (stress->fds[0], SHUT_RDWR);
+    if (stress->thread) g_thread_join (stress->thread);
+    if (stress->fds[0] >= 0) close (stress->fds[0]);
+    if (stress->probe_id) g_source_remove (stress->probe_id);
+    g_free (stress->lag);
+    g_free (stress);
+    stress = NULL;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
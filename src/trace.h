@@ -0,0 +1,81 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Static tracepoints for perf and bpftrace, under the provider pplug_power.
+ * When built without sys/sdt.h, or when no tracer is attached, they cost
+ * nothing beyond a nop in the instruction stream.
+ *
+ *   uevent_received (seqnum, subsystem, action)
+ *   event_filtered (seqnum, subsystem)
+ *   alarm_read (seqnum, value)         first byte of the alarm attribute
+ *   condition_set (reason)             icon reason flag
+ *   notification_sent (kind)
+ *   icon_updated (reasons)             icon reason flags shown
+ *   startup_phase (name)
+ */
+
+#ifndef POWER_TRACE_H
+#define POWER_TRACE_H
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define TRACE1(name,a)      DTRACE_PROBE1 (pplug_power, name, a)
+#define TRACE2(name,a,b)    DTRACE_PROBE2 (pplug_power, name, a, b)
+#define TRACE3(name,a,b,c)  DTRACE_PROBE3 (pplug_power, name, a, b, c)
+
+#else
+
+#define TRACE1(name,a)      do { } while (0)
+#define TRACE2(name,a,b)    do { } while (0)
+#define TRACE3(name,a,b,c)  do { } while (0)
+
+#endif
+
+/* Sysprof capture marks, so that the plugin's GTK work appears in the same
+ * timeline as the toolkit and compositor when profiling the whole panel */
+
+#ifdef HAVE_SYSPROF
+
+#include <sysprof-capture.h>
+
+#define MARK_BEGIN(name)        gint64 mark_##name##_ = SYSPROF_CAPTURE_CURRENT_TIME
+#define MARK_END(name,msg)      sysprof_collector_mark (mark_##name##_, SYSPROF_CAPTURE_CURRENT_TIME - mark_##name##_, \
+                                    "pplug-power", #name, msg)
+
+#else
+
+#define MARK_BEGIN(name)
+#define MARK_END(name,msg)      do { } while (0)
+
+#endif
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,63 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#ifndef POWER_UEVENT_FILE_H
+#define POWER_UEVENT_FILE_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Uevent recording - a file header followed by one record per event. Each
+ * record is the raw netlink payload ("action@devpath" then NUL-terminated
+ * KEY=VALUE strings) preceded by its receive time relative to the start of
+ * the recording. The recorder appends PPLUG_ALARM=<c> holding the first
+ * byte of the relevant alarm attribute as it was when the event arrived. */
+
+#define UEVENT_FILE_MAGIC   "PPUE"
+#define UEVENT_FILE_VERSION 1
+#define UEVENT_PAYLOAD_MAX  8192
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+} UeventFileHeader;
+
+typedef struct
+{
+    uint64_t time_us;               /* Monotonic time since start of recording */
+    uint32_t len;                   /* Payload bytes following this header */
+    uint32_t reserved;
+} UeventRecordHeader;
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,204 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Records kernel uevents for the subsystems the power plugin is interested
+ * in, for later replay into the plugin with "pplug-power-harness replay <file>" */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "uevent-file.h"
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static const char *subsystems[] = { "usb", "hwmon", "thermal", "power_supply", NULL };
+
+static volatile sig_atomic_t stop;
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+static void handle_signal (int)
+{
+    stop = 1;
+}
+
+static uint64_t now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Find the value of a key in a uevent payload */
+static const char *get_key (const char *buf, size_t len, const char *key)
+{
+    size_t klen = strlen (key);
+    const char *ptr = buf, *end = buf + len;
+
+    while (ptr < end)
+    {
+        if (!strncmp (ptr, key, klen) && ptr[klen] == '=') return ptr + klen + 1;
+        ptr += strlen (ptr) + 1;
+    }
+    return NULL;
+}
+
+/* Read the first byte of the alarm attribute the plugin would read for this event */
+static int read_alarm (const char *buf, size_t len, const char *subsystem)
+{
+    const char *val;
+    char path[4096];
+    int fd, res = -1;
+    char c;
+
+    if (!strcmp (subsystem, "usb"))
+    {
+        if (!(val = get_key (buf, len, "OVER_CURRENT_PORT"))) return -1;
+        snprintf (path, sizeof (path), "/sys/%s/disable", val);
+    }
+    else if (!strcmp (subsystem, "hwmon"))
+    {
+        if (!(val = get_key (buf, len, "DEVPATH"))) return -1;
+        snprintf (path, sizeof (path), "/sys%s/in0_lcrit_alarm", val);
+    }
+    else return -1;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (read (fd, &c, 1) == 1) res = c;
+    close (fd);
+    return res;
+}
+
+int main (int argc, char *argv[])
+{
+    struct sockaddr_nl addr;
+    UeventFileHeader fhdr;
+    UeventRecordHeader rhdr;
+    char buf[UEVENT_PAYLOAD_MAX + 16];
+    const char *subsystem;
+    uint64_t start;
+    ssize_t len;
+    unsigned long count = 0;
+    struct sigaction sa;
+    int sock, i, alarm;
+    FILE *fp;
+
+    if (argc != 2)
+    {
+        fprintf (stderr, "Usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+
+    sock = socket (AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (sock < 0)
+    {
+        perror ("socket");
+        return 1;
+    }
+
+    /* Group 1 is the raw kernel broadcast, before udevd has processed it */
+    memset (&addr, 0, sizeof (addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind (sock, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+        perror ("bind");
+        return 1;
+    }
+
+    fp = fopen (argv[1], "wb");
+    if (!fp)
+    {
+        perror (argv[1]);
+        return 1;
+    }
+
+    memcpy (fhdr.magic, UEVENT_FILE_MAGIC, 4);
+    fhdr.version = UEVENT_FILE_VERSION;
+    fwrite (&fhdr, sizeof (fhdr), 1, fp);
+
+    /* Without SA_RESTART, so that a signal interrupts the blocking recv */
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+
+    start = now_us ();
+    while (!stop)
+    {
+        len = recv (sock, buf, UEVENT_PAYLOAD_MAX, 0);
+        if (len < 0)
+        {
+            if (errno == EINTR) continue;
+            perror ("recv");
+            break;
+        }
+        rhdr.time_us = now_us () - start;
+
+        /* Netlink payloads are not guaranteed to end with a NUL */
+        if (len == 0 || buf[len - 1]) buf[len++] = 0;
+
+        subsystem = get_key (buf, len, "SUBSYSTEM");
+        if (!subsystem) continue;
+        for (i = 0; subsystems[i]; i++)
+            if (!strcmp (subsystem, subsystems[i])) break;
+        if (!subsystems[i]) continue;
+
+        alarm = read_alarm (buf, len, subsystem);
+        if (alarm > 0) len += snprintf (buf + len, sizeof (buf) - len, "PPLUG_ALARM=%c", alarm) + 1;
+
+        rhdr.len = len;
+        rhdr.reserved = 0;
+        fwrite (&rhdr, sizeof (rhdr), 1, fp);
+        fwrite (buf, 1, len, fp);
+        fflush (fp);
+        count++;
+    }
+
+    fclose (fp);
+    close (sock);
+    fprintf (stderr, "%lu events recorded\n", count);
+    return 0;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/